@@ -0,0 +1,20 @@
+#ifndef __LIB_KERNEL_LZ_H
+#define __LIB_KERNEL_LZ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Small LZ77 compressor in the LZ4 block format, for compressing
+   pages in memory. */
+
+/* Entries in the match-finder table the caller provides. */
+#define LZ_HASH_BITS 10
+#define LZ_TABLE_SIZE (1 << LZ_HASH_BITS)
+
+size_t lz_compress (const void *src, size_t src_len,
+		void *dst, size_t dst_cap, uint16_t *table);
+bool lz_decompress (const void *src, size_t src_len,
+		void *dst, size_t dst_len);
+
+#endif /* lib/kernel/lz.h */
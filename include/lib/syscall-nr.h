@@ -22,6 +22,8 @@ enum {
 	/* Project 3 and optionally project 4. */
 	SYS_MMAP,                   /* Map a file into memory. */
 	SYS_MUNMAP,                 /* Remove a memory mapping. */
+	SYS_MADVISE,                /* Advise on use of a memory range. */
+	SYS_MSYNC,                  /* Write back a memory mapping. */
 
 	/* Project 4 only. */
 	SYS_CHDIR,                  /* Change the current directory. */
@@ -38,4 +40,18 @@ enum {
 	SYS_UMOUNT,
 };
 
+/* Flag for the WRITABLE argument of mmap(): load the whole
+   mapping right away instead of on first touch. */
+#define MAP_POPULATE 0x2
+
+/* Advice for madvise(). */
+enum {
+	MADV_NORMAL,                /* No special treatment. */
+	MADV_RANDOM,                /* Random access: read no more than asked. */
+	MADV_SEQUENTIAL,            /* Sequential access: read far ahead,
+	                               and evict pages soon after use. */
+	MADV_WILLNEED,              /* Will be used soon: load it now. */
+	MADV_DONTNEED,              /* Not used for a while: page it out. */
+};
+
 #endif /* lib/syscall-nr.h */
@@ -0,0 +1,15 @@
+#ifndef THREADS_MEMPROF_H
+#define THREADS_MEMPROF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* -memprof: Attribute kernel allocations to their call sites? */
+extern bool memprof_enabled;
+
+void memprof_init (void);
+void memprof_alloc (const void *caller, const void *block, size_t size);
+void memprof_free (const void *block);
+void memprof_print_stats (void);
+
+#endif /* threads/memprof.h */
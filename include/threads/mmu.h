@@ -2,27 +2,56 @@
 #define THREAD_MMU_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "threads/pte.h"
 
 typedef bool pte_for_each_func (uint64_t *pte, void *va, void *aux);
 
+/* Pages unmapped from one pml4 whose TLB entries are still to be
+   invalidated, and page tables still to be freed.  See
+   pml4_clear_range(). */
+#define TLB_GATHER_PAGES 32
+#define TLB_GATHER_TABLES 32
+struct tlb_gather {
+	uint64_t *pml4;                     /* Address space. */
+	size_t page_cnt;                    /* Pages unmapped so far. */
+	void *pages[TLB_GATHER_PAGES];      /* The first of them. */
+	size_t table_cnt;                   /* Page tables to free. */
+	void *tables[TLB_GATHER_TABLES];
+};
+
+extern bool huge_pages;
+extern bool pcid_enabled;
+extern bool pcid_allowed;
+
 uint64_t *pml4e_walk (uint64_t *pml4, const uint64_t va, int create);
+uint64_t *pml4e_walk_huge (uint64_t *pml4, const uint64_t va, int create);
 uint64_t *pml4_create (void);
 bool pml4_for_each (uint64_t *, pte_for_each_func *, void *);
 void pml4_destroy (uint64_t *pml4);
+void pml4_destroy_async (uint64_t *pml4);
+void pml4_reaper_start (void);
 void pml4_activate (uint64_t *pml4);
+void pcid_init (void);
+void mmu_print_stats (void);
 void *pml4_get_page (uint64_t *pml4, const void *upage);
 bool pml4_set_page (uint64_t *pml4, void *upage, void *kpage, bool rw);
+bool pml4_set_huge_page (uint64_t *pml4, void *upage, void *kpage, bool rw);
 void pml4_clear_page (uint64_t *pml4, void *upage);
+void pml4_clear_range (struct tlb_gather *, void *upage, size_t page_cnt);
+void tlb_gather_init (struct tlb_gather *, uint64_t *pml4);
+void tlb_gather_finish (struct tlb_gather *);
 bool pml4_is_dirty (uint64_t *pml4, const void *upage);
 void pml4_set_dirty (uint64_t *pml4, const void *upage, bool dirty);
 bool pml4_is_accessed (uint64_t *pml4, const void *upage);
 void pml4_set_accessed (uint64_t *pml4, const void *upage, bool accessed);
+bool pml4_set_writable (uint64_t *pml4, const void *upage, bool writable);
 
 #define is_writable(pte) (*(pte) & PTE_W)
 #define is_user_pte(pte) (*(pte) & PTE_U)
 #define is_kern_pte(pte) (!is_user_pte (pte))
+#define is_huge_pte(pte) (*(pte) & PTE_PS)
 
 #define pte_get_paddr(pte) (pg_round_down(*(pte)))
 
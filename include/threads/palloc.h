@@ -1,14 +1,33 @@
 #ifndef THREADS_PALLOC_H
 #define THREADS_PALLOC_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <list.h>
 
 /* How to allocate pages. */
 enum palloc_flags {
 	PAL_ASSERT = 001,           /* Panic on failure. */
 	PAL_ZERO = 002,             /* Zero page contents. */
-	PAL_USER = 004              /* User page. */
+	PAL_USER = 004,             /* User page. */
+	PAL_NOPROF = 010            /* Not charged by -memprof. */
+};
+
+/* A cache that can hand pages back to the page allocator when a
+   pool runs dry.  See palloc_register_shrinker(). */
+struct shrinker {
+	const char *name;               /* Name for statistics. */
+	int priority;                   /* Lower values are asked first. */
+	bool user;                      /* Holds user pool pages? */
+	size_t (*count) (void);         /* Pages it could release now. */
+	size_t (*scan) (size_t page_cnt); /* Releases up to PAGE_CNT pages,
+	                                     returns the number released. */
+
+	/* Owned by palloc.c. */
+	struct list_elem elem;          /* Element in shrinker list. */
+	long long calls;                /* Times SCAN was called. */
+	long long reclaimed;            /* Pages released in total. */
 };
 
 /* Maximum number of pages to put in user pool. */
@@ -19,5 +38,14 @@ void *palloc_get_page (enum palloc_flags);
 void *palloc_get_multiple (enum palloc_flags, size_t page_cnt);
 void palloc_free_page (void *);
 void palloc_free_multiple (void *, size_t page_cnt);
+void *palloc_get_huge (enum palloc_flags);
+void palloc_free_huge (void *);
+bool palloc_zero_idle (void);
+void palloc_sample (int64_t ticks);
+void palloc_user_span (void **base, size_t *page_cnt);
+size_t palloc_user_pages (void);
+size_t palloc_user_free (void);
+void palloc_register_shrinker (struct shrinker *);
+void palloc_print_stats (void);
 
 #endif /* threads/palloc.h */
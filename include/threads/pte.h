@@ -27,6 +27,7 @@
 #define PDX(la)  ((((uint64_t) (la)) >> PDXSHIFT) & 0x1FF)
 #define PTX(la)  ((((uint64_t) (la)) >> PTXSHIFT) & 0x1FF)
 #define PTE_ADDR(pte) ((uint64_t) (pte) & ~0xFFF)
+#define HPTE_ADDR(pte) ((uint64_t) (pte) & ~0x1FFFFFUL)
 
 /* The important flags are listed below.
    When a PDE or PTE is not "present", the other flags are
@@ -41,5 +42,6 @@
 #define PTE_U 0x4                        /* 1=user/kernel, 0=kernel only. */
 #define PTE_A 0x20                       /* 1=accessed, 0=not acccessed. */
 #define PTE_D 0x40                       /* 1=dirty, 0=not dirty (PTEs only). */
+#define PTE_PS 0x80                      /* 1=2 MB page (PDEs only). */
 
 #endif /* threads/pte.h */
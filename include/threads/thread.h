@@ -136,6 +136,8 @@ struct thread {
 #ifdef VM
 	/* Table for whole virtual memory owned by thread. */
 	struct supplemental_page_table spt;
+	void *user_rsp;                     /* User rsp at syscall entry. */
+	long long major_faults;             /* Faults that read from disk. */
 #endif
 
 	/* Owned by thread.c. */
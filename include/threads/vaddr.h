@@ -20,11 +20,19 @@
 #define PGSIZE  (1 << PGBITS)              /* Bytes in a page. */
 #define PGMASK  BITMASK(PGSHIFT, PGBITS)   /* Page offset bits (0:12). */
 
+/* Huge page (2 MB) mapped by a single page directory entry. */
+#define HPGBITS 21                         /* Number of offset bits. */
+#define HPGSIZE (1 << HPGBITS)             /* Bytes in a huge page. */
+#define HPGMASK BITMASK(PGSHIFT, HPGBITS)  /* Huge page offset bits. */
+
 /* Offset within a page. */
 #define pg_ofs(va) ((uint64_t) (va) & PGMASK)
 
 #define pg_no(va) ((uint64_t) (va) >> PGBITS)
 
+/* Offset within a huge page. */
+#define hpg_ofs(va) ((uint64_t) (va) & HPGMASK)
+
 /* Round up to nearest page boundary. */
 #define pg_round_up(va) ((void *) (((uint64_t) (va) + PGSIZE - 1) & ~PGMASK))
 
@@ -1,13 +1,24 @@
 #ifndef VM_ANON_H
 #define VM_ANON_H
+#include <stddef.h>
 #include "vm/vm.h"
 struct page;
+struct zpage;
 enum vm_type;
 
 struct anon_page {
+	size_t slot;                /* Swap slot, BITMAP_ERROR if none. */
+	struct zpage *zpage;        /* Compressed copy, or NULL. */
+	struct frame *cache;        /* Copy read ahead, or NULL. */
 };
 
+extern unsigned zswap_percent;
+
 void vm_anon_init (void);
 bool anon_initializer (struct page *page, enum vm_type type, void *kva);
+size_t anon_swap_out_cluster (struct page *pages[], size_t cnt, bool out[]);
+struct frame *anon_take_cache (struct page *page);
+void anon_drop_cache (struct frame *frame);
+void anon_print_stats (void);
 
 #endif
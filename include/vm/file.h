@@ -6,12 +6,28 @@
 struct page;
 enum vm_type;
 
+/* Where a file-backed page's contents live.  Each page holds its
+ * own reopened FILE, so closing one mapping leaves the others.  The
+ * same struct, malloc()'d, is the aux of pages still to be loaded
+ * from a file: mmap'd pages and executable segments. */
 struct file_page {
+	struct file *file;          /* File, reopened for this page. */
+	off_t ofs;                  /* Offset in FILE of the page. */
+	size_t read_bytes;          /* Bytes to read; the rest is zero. */
+	size_t map_pages;           /* Pages in the mapping, 0 if not first. */
+	bool shared;                /* Read-only text, see vm/text.c. */
 };
 
+extern int64_t flush_interval;
+
 void vm_file_init (void);
 bool file_backed_initializer (struct page *page, enum vm_type type, void *kva);
 void *do_mmap(void *addr, size_t length, int writable,
 		struct file *file, off_t offset);
 void do_munmap (void *va);
+struct file_page *file_page_dup (const struct file_page *);
+void file_page_free (struct file_page *);
+bool file_msync (void *addr, size_t length);
+void flusher_start (void);
+void file_print_stats (void);
 #endif
@@ -0,0 +1,33 @@
+#ifndef VM_FRAME_H
+#define VM_FRAME_H
+#include <stdbool.h>
+#include <stddef.h>
+
+struct frame;
+
+/* Frame flags. */
+#define FRAME_USED 0x1          /* Allocated with frame_alloc(). */
+#define FRAME_PINNED 0x2        /* Under I/O, must stay put. */
+#define FRAME_TEXT 0x4          /* Shared text, see vm/text.c. */
+#define FRAME_SWAPCACHE 0x8     /* Read ahead from swap, unmapped. */
+#define FRAME_HOT 0x10          /* On FRAME_AM rather than FRAME_A1IN. */
+
+/* Replacement lists of the 2Q policy, see vm_get_victim(). */
+enum frame_list {
+	FRAME_A1IN,                 /* New frames, oldest first. */
+	FRAME_AM,                   /* Hot frames, least recently used first. */
+};
+
+void frame_init (void);
+struct frame *frame_alloc (void);
+struct frame *frame_alloc_multiple (size_t cnt);
+void frame_free (struct frame *);
+struct frame *frame_of (const void *kva);
+struct frame *frame_at (size_t idx);
+size_t frame_cnt (void);
+void frame_list_move (struct frame *, enum frame_list);
+void frame_list_remove (struct frame *);
+struct frame *frame_list_front (enum frame_list);
+size_t frame_list_size (enum frame_list);
+
+#endif /* vm/frame.h */
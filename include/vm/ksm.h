@@ -0,0 +1,10 @@
+#ifndef VM_KSM_H
+#define VM_KSM_H
+#include <stdbool.h>
+
+extern bool ksm_enabled;
+
+void ksm_start (void);
+void ksm_print_stats (void);
+
+#endif /* vm/ksm.h */
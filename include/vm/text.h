@@ -0,0 +1,31 @@
+#ifndef VM_TEXT_H
+#define VM_TEXT_H
+#include <hash.h>
+#include <list.h>
+#include "filesys/off_t.h"
+
+struct frame;
+struct inode;
+struct page;
+
+/* A page of read-only executable text in memory, shared by every
+ * process that maps the same page of the same file. */
+struct text_page {
+	struct hash_elem elem;      /* Element in the text cache. */
+	struct inode *inode;        /* File... */
+	off_t ofs;                  /* ...and offset: the key. */
+	struct frame *frame;        /* Frame holding the page. */
+	struct list mappers;        /* Pages mapping it, by text_elem. */
+};
+
+void text_init (void);
+struct text_page *text_find (struct inode *, off_t ofs);
+bool text_cached (struct inode *, off_t ofs);
+struct text_page *text_insert (struct inode *, off_t ofs, struct frame *);
+void text_map (struct text_page *, struct page *);
+bool text_unmap (struct text_page *, struct page *);
+void text_evict (struct text_page *);
+bool text_clear_accessed (struct text_page *);
+void text_print_stats (void);
+
+#endif /* vm/text.h */
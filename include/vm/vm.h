@@ -1,7 +1,10 @@
 #ifndef VM_VM_H
 #define VM_VM_H
 #include <stdbool.h>
+#include <list.h>
+#include <stdint.h>
 #include "threads/palloc.h"
+#include "threads/synch.h"
 
 enum vm_type {
 	/* page not initialized */
@@ -27,6 +30,7 @@ enum vm_type {
 #include "vm/uninit.h"
 #include "vm/anon.h"
 #include "vm/file.h"
+#include "vm/text.h"
 #ifdef EFILESYS
 #include "filesys/page_cache.h"
 #endif
@@ -46,6 +50,14 @@ struct page {
 	struct frame *frame;   /* Back reference for frame */
 
 	/* Your implementation */
+	struct thread *owner;  /* Process whose pml4 maps the page. */
+	bool writable;         /* Mapped read/write? */
+	bool ahead;            /* Mapped by fault-around, maybe unused. */
+	uint8_t advice;        /* MADV_RANDOM, MADV_SEQUENTIAL or 0. */
+	struct text_page *text;     /* Shared text mapped, if any. */
+	struct list_elem text_elem; /* Element in its mappers. */
+	struct page *rmap_next;     /* Next page mapping FRAME. */
+	unsigned ghost;             /* 2Q ghost number, 0 if none. */
 
 	/* Per-type data are binded into the union.
 	 * Each function automatically detects the current union */
@@ -59,10 +71,16 @@ struct page {
 	};
 };
 
-/* The representation of "frame" */
+/* The representation of "frame".  There is one for every page
+ * of the user pool, found in constant time with frame_of(); see
+ * vm/frame.c. */
 struct frame {
-	void *kva;
-	struct page *page;
+	void *kva;                  /* Kernel virtual address. */
+	struct page *page;          /* First page mapping it, if any. */
+	struct list_elem lru;       /* Element in a replacement list. */
+	uint16_t ref_cnt;           /* Mappings sharing this frame. */
+	uint16_t flags;             /* FRAME_* bits, see vm/frame.h. */
+	struct text_page *text;     /* Text cache entry if FRAME_TEXT. */
 };
 
 /* The function table for page operations.
@@ -82,11 +100,26 @@ struct page_operations {
 	if ((page)->operations->destroy) (page)->operations->destroy (page)
 
 /* Representation of current process's memory space.
- * We don't want to force you to obey any specific design for this struct.
- * All designs up to you for this. */
+ *
+ * A radix tree keyed by virtual page number that mirrors the x86-64
+ * paging structure: four levels of 512-entry nodes, one page each,
+ * indexed like PML4, PDPT, page directory and page table.  Leaf
+ * entries point to struct pages.  An entry pointing to a node
+ * keeps the number of non-null entries of that node in its low
+ * PGBITS bits, the way a PTE keeps flags, so emptied nodes can be
+ * freed without scanning them.  See vm/vm.c. */
 struct supplemental_page_table {
+	uintptr_t *root;            /* Top-level node, or null. */
+	size_t root_cnt;            /* Non-null entries in ROOT. */
+	size_t page_cnt;            /* Pages in the table. */
+	size_t node_cnt;            /* Nodes allocated. */
+	size_t peak_node_cnt;       /* Most nodes ever allocated at once. */
 };
 
+/* Called by spt_for_each() for each page, with AUX.  Returning false
+ * stops the walk. */
+typedef bool spt_action_func (struct page *, void *aux);
+
 #include "threads/thread.h"
 void supplemental_page_table_init (struct supplemental_page_table *spt);
 bool supplemental_page_table_copy (struct supplemental_page_table *dst,
@@ -96,8 +129,25 @@ struct page *spt_find_page (struct supplemental_page_table *spt,
 		void *va);
 bool spt_insert_page (struct supplemental_page_table *spt, struct page *page);
 void spt_remove_page (struct supplemental_page_table *spt, struct page *page);
+bool spt_for_each (struct supplemental_page_table *spt, void *start, void *end,
+		spt_action_func *action, void *aux);
+bool spt_range_is_free (struct supplemental_page_table *spt,
+		void *start, void *end);
+
+/* Frame replacement policies, see vm_get_victim(). */
+enum evict_policy {
+	EVICT_CLOCK,                /* Second-chance clock. */
+	EVICT_2Q,                   /* Scan-resistant 2Q. */
+};
+
+extern enum evict_policy evict_policy;
+extern bool fault_stats;
+extern size_t fault_around_pages;
+extern bool kswapd_enabled;
+extern struct lock vm_lock;
 
 void vm_init (void);
+void kswapd_start (void);
 bool vm_try_handle_fault (struct intr_frame *f, void *addr, bool user,
 		bool write, bool not_present);
 
@@ -108,5 +158,11 @@ bool vm_alloc_page_with_initializer (enum vm_type type, void *upage,
 void vm_dealloc_page (struct page *page);
 bool vm_claim_page (void *va);
 enum vm_type page_get_type (struct page *page);
+void vm_free_frame (struct page *page);
+struct frame *vm_zero_frame (void);
+void vm_merge_frame (struct page *page, struct frame *into);
+void vm_unmap_range (void *start, size_t page_cnt);
+bool vm_madvise (void *addr, size_t length, int advice);
+void vm_print_stats (void);
 
 #endif  /* VM_VM_H */
@@ -0,0 +1,179 @@
+#include "lz.h"
+#include <debug.h>
+#include <string.h>
+
+/* A compressed block is a series of sequences, each a run of
+   literal bytes followed by a match: a copy of earlier output.
+
+     token          high nibble: literal count, low: match length - 4;
+                    15 in either means more length bytes follow
+     [length...]    literal count - 15 as bytes of 255 and a final
+                    byte less than 255
+     literals
+     offset         2 bytes, little-endian: distance back to copy from
+     [length...]    match length - 19, encoded the same way
+
+   The last sequence has literals only and ends the block.  This is
+   the LZ4 block format, without its rules about how close to the
+   end a match may be. */
+
+#define MIN_MATCH 4
+
+/* Reads 4 bytes at P. */
+static inline uint32_t
+read32 (const uint8_t *p) {
+	uint32_t v;
+	memcpy (&v, p, sizeof v);
+	return v;
+}
+
+/* Returns the table slot for the 4 bytes V. */
+static inline size_t
+hash32 (uint32_t v) {
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Appends length LEN - 15 to *OP as bytes of 255 and a last byte
+   below 255, if there is room before END.  Returns false if not. */
+static bool
+put_length (uint8_t **op, const uint8_t *end, size_t len) {
+	for (len -= 15; len >= 255; len -= 255) {
+		if (*op >= end)
+			return false;
+		*(*op)++ = 255;
+	}
+	if (*op >= end)
+		return false;
+	*(*op)++ = len;
+	return true;
+}
+
+/* Appends to *OP, not past END, the sequence of the LIT_LEN literal
+   bytes at LIT followed by a match of MATCH_LEN bytes OFFSET back,
+   or no match if MATCH_LEN is 0.  Returns false if there is no
+   room. */
+static bool
+put_sequence (uint8_t **op, const uint8_t *end, const uint8_t *lit,
+		size_t lit_len, size_t offset, size_t match_len) {
+	size_t ml = match_len > 0 ? match_len - MIN_MATCH : 0;
+	uint8_t *token = *op;
+
+	if (*op >= end)
+		return false;
+	*token = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+	(*op)++;
+	if (lit_len >= 15 && !put_length (op, end, lit_len))
+		return false;
+	if ((size_t) (end - *op) < lit_len)
+		return false;
+	memcpy (*op, lit, lit_len);
+	*op += lit_len;
+	if (match_len == 0)
+		return true;
+
+	if (end - *op < 2)
+		return false;
+	*(*op)++ = offset & 0xff;
+	*(*op)++ = offset >> 8;
+	return ml < 15 || put_length (op, end, ml);
+}
+
+/* Compresses the SRC_LEN bytes at SRC, at most 64 kB, into DST,
+   which has room for DST_CAP bytes.  TABLE is scratch space of
+   LZ_TABLE_SIZE entries.  Returns the compressed size, or 0 if it
+   would not fit in DST_CAP bytes. */
+size_t
+lz_compress (const void *src_, size_t src_len,
+		void *dst_, size_t dst_cap, uint16_t *table) {
+	const uint8_t *src = src_;
+	uint8_t *op = dst_;
+	const uint8_t *end = op + dst_cap;
+	size_t ip = 0, anchor = 0;
+
+	ASSERT (src_len <= 65536);
+	memset (table, 0, LZ_TABLE_SIZE * sizeof *table);
+
+	while (ip + MIN_MATCH <= src_len) {
+		uint32_t v = read32 (src + ip);
+		size_t h = hash32 (v);
+		size_t ref = table[h];
+		size_t len;
+
+		table[h] = ip;
+		if (ref >= ip || read32 (src + ref) != v) {
+			ip++;
+			continue;
+		}
+
+		for (len = MIN_MATCH; ip + len < src_len
+				&& src[ref + len] == src[ip + len]; len++)
+			continue;
+		if (!put_sequence (&op, end, src + anchor, ip - anchor, ip - ref, len))
+			return 0;
+		ip += len;
+		anchor = ip;
+	}
+
+	if (!put_sequence (&op, end, src + anchor, src_len - anchor, 0, 0))
+		return 0;
+	return op - (uint8_t *) dst_;
+}
+
+/* Reads a length continued from NIBBLE at *IP, not past END, into
+   *LEN.  Returns false if the input ends first. */
+static bool
+get_length (const uint8_t **ip, const uint8_t *end, size_t nibble,
+		size_t *len) {
+	*len = nibble;
+	if (nibble < 15)
+		return true;
+	for (;;) {
+		if (*ip >= end)
+			return false;
+		*len += **ip;
+		if (*(*ip)++ != 255)
+			return true;
+	}
+}
+
+/* Decompresses the SRC_LEN bytes at SRC, made by lz_compress(), into
+   DST.  Returns true if that produced exactly DST_LEN bytes, false
+   if the input is corrupt or the output would not fit. */
+bool
+lz_decompress (const void *src, size_t src_len, void *dst_, size_t dst_len) {
+	const uint8_t *ip = src;
+	const uint8_t *end = ip + src_len;
+	uint8_t *dst = dst_;
+	size_t op = 0;
+
+	for (;;) {
+		size_t lit_len, match_len, offset, i;
+		uint8_t token;
+
+		if (ip >= end)
+			return false;
+		token = *ip++;
+		if (!get_length (&ip, end, token >> 4, &lit_len)
+				|| (size_t) (end - ip) < lit_len || dst_len - op < lit_len)
+			return false;
+		memcpy (dst + op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		if (ip == end)
+			return op == dst_len;
+
+		if (end - ip < 2)
+			return false;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (!get_length (&ip, end, token & 15, &match_len))
+			return false;
+		match_len += MIN_MATCH;
+		if (offset == 0 || offset > op || dst_len - op < match_len)
+			return false;
+
+		/* Byte by byte, since the copy may overlap itself. */
+		for (i = 0; i < match_len; i++, op++)
+			dst[op] = dst[op - offset];
+	}
+}
@@ -0,0 +1,65 @@
+/* Switch-heavy workload for timing address space switches.
+   First forks and waits for a long series of short-lived
+   children, then runs several children side by side, each
+   walking its own 64-page working set while the timer keeps
+   preempting them.  Every switch loads a different pml4, so
+   comparing the user ticks and the PCID line printed at power
+   off with and without the -nopcid kernel option shows what
+   the TLB refills cost.  QEMU must be given a CPU model that
+   reports PCID, e.g. "-cpu qemu64,+pcid". */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGES 64
+#define SPAWNS 64
+#define CHILDREN 4
+#define ROUNDS 4000
+
+static unsigned char buf[PAGES * 4096];
+
+/* Stamps one byte in each page of BUF with SEED, then reads them
+   back ROUNDS times.  Returns 0 if every read matched. */
+static int
+walk (int seed, int rounds)
+{
+  int i, round;
+
+  for (i = 0; i < PAGES; i++)
+    buf[i * 4096] = seed + i;
+  for (round = 0; round < rounds; round++)
+    for (i = 0; i < PAGES; i++)
+      if (buf[i * 4096] != (unsigned char) (seed + i))
+        return 1;
+  return 0;
+}
+
+void
+test_main (void)
+{
+  pid_t pids[CHILDREN];
+  int i;
+
+  msg ("fork and wait");
+  for (i = 0; i < SPAWNS; i++)
+    {
+      pid_t pid = fork ("child");
+      if (pid == 0)
+        exit (walk (i, 16));
+      if (wait (pid) != 0)
+        fail ("child %d failed", i);
+    }
+
+  msg ("concurrent walkers");
+  for (i = 0; i < CHILDREN; i++)
+    {
+      pids[i] = fork ("walker");
+      if (pids[i] == 0)
+        exit (walk (i, ROUNDS));
+    }
+  for (i = 0; i < CHILDREN; i++)
+    if (wait (pids[i]) != 0)
+      fail ("walker %d failed", i);
+  msg ("done");
+}
@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(pcid-switch) begin
+(pcid-switch) fork and wait
+(pcid-switch) concurrent walkers
+(pcid-switch) done
+(pcid-switch) end
+EOF
+pass;
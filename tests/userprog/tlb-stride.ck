@@ -0,0 +1,13 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(tlb-stride) begin
+(tlb-stride) initialize
+(tlb-stride) stride walk
+(tlb-stride) checksum ok
+(tlb-stride) end
+tlb-stride: exit(0)
+EOF
+pass;
@@ -0,0 +1,50 @@
+/* Fills 1 MB of memory and forks.  The child checks that it sees
+   the parent's data, overwrites it, and checks its own writes;
+   the parent then checks that its copy is untouched and writes
+   to it again.  With copy-on-write fork, the child copies every
+   page it writes, and the parent, by then the only user of its
+   frames, takes them back without copying. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (1024 * 1024)
+
+static char buf[SIZE];
+
+/* Fails unless every byte of BUF is VALUE. */
+static void
+check_buf (char value, const char *who)
+{
+  size_t i;
+
+  for (i = 0; i < SIZE; i++)
+    if (buf[i] != value)
+      fail ("%s: byte %zu is %d, expected %d", who, i, buf[i], value);
+  msg ("%s: buffer intact", who);
+}
+
+void
+test_main (void)
+{
+  int pid;
+
+  memset (buf, 'p', SIZE);
+  if ((pid = fork ("child")))
+    {
+      int status = wait (pid);
+      msg ("Parent: child exit status is %d", status);
+      check_buf ('p', "parent");
+      memset (buf, 'q', SIZE);
+      check_buf ('q', "parent");
+    }
+  else
+    {
+      check_buf ('p', "child");
+      memset (buf, 'c', SIZE);
+      check_buf ('c', "child");
+      exit (81);
+    }
+}
@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(cow-fork) begin
+(cow-fork) child: buffer intact
+(cow-fork) child: buffer intact
+child: exit(81)
+(cow-fork) Parent: child exit status is 81
+(cow-fork) parent: buffer intact
+(cow-fork) parent: buffer intact
+(cow-fork) end
+cow-fork: exit(0)
+EOF
+pass;
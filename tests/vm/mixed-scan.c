@@ -0,0 +1,103 @@
+/* Runs a process that scans a file much larger than its share of
+   memory alongside several that keep reusing small working sets,
+   as a benchmark of frame replacement.  Under the clock, the scan
+   can push the working sets out over and over; a scan-resistant
+   policy such as 2Q should keep them in memory.  Run with
+   -faultstats, each process reports its major faults as it exits;
+   the default flags use -replace=2q, and running again with
+   -replace=clock gives the numbers to compare against. */
+
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define PAGE_SIZE 4096
+#define WS_CNT 3                /* Working-set processes. */
+#define WS_PAGES 48             /* Pages in each working set. */
+#define WS_ROUNDS 400           /* Passes over a working set. */
+#define WS_STRIDE 64            /* Bytes between touched bytes. */
+#define SCAN_PASSES 4           /* Passes over the file. */
+
+static char ws[WS_PAGES * PAGE_SIZE];
+
+/* Passes over the working set WS_ROUNDS times, checking at each
+   touched byte what the last pass wrote and writing the next
+   value. */
+static void
+run_ws (int id)
+{
+  int round;
+  size_t i;
+
+  for (round = 0; round < WS_ROUNDS; round++)
+    {
+      char old = id + round - 1;
+      char new = id + round;
+
+      for (i = 0; i < sizeof ws; i += WS_STRIDE)
+        {
+          if (round > 0 && ws[i] != old)
+            fail ("ws%d: byte %zu is %d in round %d, expected %d",
+                  id, i, ws[i], round, old);
+          ws[i] = new;
+        }
+    }
+}
+
+/* Reads all of "large.txt" through a mapping SCAN_PASSES times,
+   checking that each pass sums to the same value. */
+static void
+run_scan (void)
+{
+  char *actual = (char *) 0x10000000;
+  unsigned first = 0;
+  int handle, pass;
+  size_t size, i;
+  void *map;
+
+  quiet = true;
+  CHECK ((handle = open ("large.txt")) > 1, "open \"large.txt\"");
+  size = filesize (handle);
+  CHECK ((map = mmap (actual, size, 0, handle, 0)) != MAP_FAILED,
+         "mmap \"large.txt\"");
+  for (pass = 0; pass < SCAN_PASSES; pass++)
+    {
+      unsigned sum = 0;
+
+      for (i = 0; i < size; i++)
+        sum += (unsigned char) actual[i];
+      if (pass == 0)
+        first = sum;
+      else if (sum != first)
+        fail ("scan: pass %d sums to %u, expected %u", pass, sum, first);
+    }
+  munmap (map);
+  close (handle);
+}
+
+void
+test_main (void)
+{
+  pid_t children[WS_CNT + 1];
+  char names[WS_CNT + 1][16];
+  int i;
+
+  for (i = 0; i <= WS_CNT; i++)
+    {
+      if (i < WS_CNT)
+        snprintf (names[i], sizeof names[i], "ws%d", i);
+      else
+        snprintf (names[i], sizeof names[i], "scan");
+      if ((children[i] = fork (names[i])) == 0)
+        {
+          if (i < WS_CNT)
+            run_ws (i);
+          else
+            run_scan ();
+          exit (0);
+        }
+    }
+  for (i = 0; i <= WS_CNT; i++)
+    CHECK (wait (children[i]) == 0, "wait for %s", names[i]);
+}
@@ -0,0 +1,32 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+
+our ($test);
+my (@output) = read_text_file ("$test.output");
+common_checks ("run", @output);
+
+# Each process reports its major faults as it exits, in an order
+# that depends on scheduling.
+my (@procs) = qw (ws0 ws1 ws2 scan);
+my (%faults);
+foreach (@output) {
+    my ($name, $cnt) = /^(\S+): (\d+) major faults$/ or next;
+    $faults{$name} = $cnt;
+}
+foreach my $name (@procs) {
+    fail "$name did not report its major faults (run with -faultstats)\n"
+      if !defined $faults{$name};
+}
+@output = grep (!/: \d+ major faults$/, @output);
+
+compare_output ("run", IGNORE_EXIT_CODES => 1, \@output, [<<'EOF']);
+(mixed-scan) begin
+(mixed-scan) wait for ws0
+(mixed-scan) wait for ws1
+(mixed-scan) wait for ws2
+(mixed-scan) wait for scan
+(mixed-scan) end
+EOF
+pass (map ("$_: $faults{$_} major faults\n", @procs));
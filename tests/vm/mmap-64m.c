@@ -0,0 +1,42 @@
+/* Maps 64 MB of "large.txt" (the part past the end of the file
+   reads as zeros), touches every page, and unmaps it, then maps
+   and touches it again and exits with the mapping still in
+   place.  Both teardowns clear 16,384 pages at once, so the TLB
+   gather line printed at power off shows how many invalidations
+   they took, and the kernel ticks show what munmap and exit
+   cost. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define ACTUAL ((char *) 0x10000000)
+#define SIZE (64 * 1024 * 1024)
+
+/* Maps SIZE bytes of HANDLE at ACTUAL and reads one byte from
+   every page. */
+static void
+map_and_touch (int handle)
+{
+  volatile char *map;
+  size_t ofs;
+  int sum = 0;
+
+  CHECK ((map = mmap (ACTUAL, SIZE, 0, handle, 0)) != MAP_FAILED,
+         "mmap 64 MB");
+  for (ofs = 0; ofs < SIZE; ofs += 4096)
+    sum += map[ofs];
+  msg ("touched %d pages", SIZE / 4096);
+}
+
+void
+test_main (void)
+{
+  int handle;
+
+  CHECK ((handle = open ("large.txt")) > 1, "open \"large.txt\"");
+  map_and_touch (handle);
+  munmap (ACTUAL);
+  msg ("munmap");
+  map_and_touch (handle);
+}
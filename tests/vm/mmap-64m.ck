@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(mmap-64m) begin
+(mmap-64m) open "large.txt"
+(mmap-64m) mmap 64 MB
+(mmap-64m) touched 16384 pages
+(mmap-64m) munmap
+(mmap-64m) mmap 64 MB
+(mmap-64m) touched 16384 pages
+(mmap-64m) end
+mmap-64m: exit(0)
+EOF
+pass;
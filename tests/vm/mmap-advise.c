@@ -0,0 +1,55 @@
+/* Maps "large.txt" with MAP_POPULATE and reads it through under
+   each kind of madvise() advice, checking the contents every time.
+   Pages written before MADV_DONTNEED pages them out must read back
+   with the new data, and unknown advice must be refused. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+#include "tests/vm/large.inc"
+
+#define ACTUAL ((char *) 0x10000000)
+
+/* Fails unless the SIZE bytes mapped at ACTUAL match LARGE. */
+static void
+check_map (size_t size, const char *when)
+{
+  if (memcmp (ACTUAL, large, size))
+    fail ("mapping differs from \"large.txt\" %s", when);
+  msg ("contents match %s", when);
+}
+
+void
+test_main (void)
+{
+  size_t size = sizeof large - 1;
+  size_t ofs;
+  int handle;
+
+  CHECK ((handle = open ("large.txt")) > 1, "open \"large.txt\"");
+  CHECK (mmap (ACTUAL, size, 1 | MAP_POPULATE, handle, 0) == ACTUAL,
+         "mmap \"large.txt\" with MAP_POPULATE");
+  check_map (size, "after populate");
+
+  CHECK (madvise (ACTUAL, size, MADV_DONTNEED) == 0, "MADV_DONTNEED");
+  CHECK (madvise (ACTUAL, size, MADV_SEQUENTIAL) == 0, "MADV_SEQUENTIAL");
+  check_map (size, "in sequence");
+
+  /* Change one byte per page, page everything out, and read it
+     back from the file. */
+  for (ofs = 0; ofs < size; ofs += 4096)
+    ACTUAL[ofs] = large[ofs] = 'x';
+  CHECK (madvise (ACTUAL, size, MADV_DONTNEED) == 0, "MADV_DONTNEED");
+  CHECK (madvise (ACTUAL, size, MADV_RANDOM) == 0, "MADV_RANDOM");
+  check_map (size, "at random");
+
+  CHECK (madvise (ACTUAL, size, MADV_WILLNEED) == 0, "MADV_WILLNEED");
+  check_map (size, "after MADV_WILLNEED");
+
+  CHECK (madvise (ACTUAL, size, 99) == -1, "refuse unknown advice");
+  CHECK (madvise (ACTUAL + 1, size, MADV_NORMAL) == -1,
+         "refuse misaligned address");
+  munmap (ACTUAL);
+  close (handle);
+}
@@ -0,0 +1,23 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(mmap-advise) begin
+(mmap-advise) open "large.txt"
+(mmap-advise) mmap "large.txt" with MAP_POPULATE
+(mmap-advise) contents match after populate
+(mmap-advise) MADV_DONTNEED
+(mmap-advise) MADV_SEQUENTIAL
+(mmap-advise) contents match in sequence
+(mmap-advise) MADV_DONTNEED
+(mmap-advise) MADV_RANDOM
+(mmap-advise) contents match at random
+(mmap-advise) MADV_WILLNEED
+(mmap-advise) contents match after MADV_WILLNEED
+(mmap-advise) refuse unknown advice
+(mmap-advise) refuse misaligned address
+(mmap-advise) end
+mmap-advise: exit(0)
+EOF
+pass;
@@ -0,0 +1,46 @@
+/* Writes to a file through a mapping and calls msync(), then,
+   with the mapping still in place, reads the data back using the
+   read system call to verify that it reached the file.  Writes
+   again and checks that a second msync() writes the new data. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/vm/sample.inc"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define ACTUAL ((char *) 0x10000000)
+
+/* Reads "sample.txt" through HANDLE and compares it with EXPECT. */
+static void
+check_synced (int handle, const char *expect)
+{
+  char buf[1024];
+  size_t size = strlen (sample);
+
+  seek (handle, 0);
+  CHECK (read (handle, buf, size) == (int) size, "read \"sample.txt\"");
+  CHECK (!memcmp (buf, expect, size), "compare file against mapping");
+}
+
+void
+test_main (void)
+{
+  size_t size = strlen (sample);
+  int handle;
+
+  CHECK (create ("sample.txt", size), "create \"sample.txt\"");
+  CHECK ((handle = open ("sample.txt")) > 1, "open \"sample.txt\"");
+  CHECK (mmap (ACTUAL, 4096, 1, handle, 0) == ACTUAL, "mmap \"sample.txt\"");
+
+  memcpy (ACTUAL, sample, size);
+  CHECK (msync (ACTUAL, 4096) == 0, "msync");
+  check_synced (handle, sample);
+
+  memset (ACTUAL, 'x', size);
+  CHECK (msync (ACTUAL, 4096) == 0, "msync");
+  check_synced (handle, ACTUAL);
+
+  munmap (ACTUAL);
+  close (handle);
+}
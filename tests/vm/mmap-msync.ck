@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(mmap-msync) begin
+(mmap-msync) create "sample.txt"
+(mmap-msync) open "sample.txt"
+(mmap-msync) mmap "sample.txt"
+(mmap-msync) msync
+(mmap-msync) read "sample.txt"
+(mmap-msync) compare file against mapping
+(mmap-msync) msync
+(mmap-msync) read "sample.txt"
+(mmap-msync) compare file against mapping
+(mmap-msync) end
+mmap-msync: exit(0)
+EOF
+pass;
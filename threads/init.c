@@ -17,6 +17,7 @@
 #include "threads/io.h"
 #include "threads/loader.h"
 #include "threads/malloc.h"
+#include "threads/memprof.h"
 #include "threads/mmu.h"
 #include "threads/palloc.h"
 #include "threads/pte.h"
@@ -30,6 +31,8 @@
 #endif
 #include "tests/threads/tests.h"
 #ifdef VM
+#include "vm/anon.h"
+#include "vm/ksm.h"
 #include "vm/vm.h"
 #endif
 #ifdef FILESYS
@@ -84,6 +87,7 @@ main (void) {
 
 	/* Initialize memory system. */
 	mem_end = palloc_init ();
+	memprof_init ();
 	malloc_init ();
 	paging_init (mem_end);
 
@@ -105,6 +109,14 @@ main (void) {
 	thread_start ();
 	serial_init_queue ();
 	timer_calibrate ();
+#ifdef USERPROG
+	pml4_reaper_start ();
+#endif
+#ifdef VM
+	ksm_start ();
+	kswapd_start ();
+	flusher_start ();
+#endif
 
 #ifdef FILESYS
 	/* Initialize file system. */
@@ -152,19 +164,32 @@ paging_init (uint64_t mem_end) {
 	extern char start, _end_kernel_text;
 	// Maps physical address [0 ~ mem_end] to
 	//   [LOADER_KERN_BASE ~ LOADER_KERN_BASE + mem_end].
-	for (uint64_t pa = 0; pa < mem_end; pa += PGSIZE) {
+	// Whole 2 MB regions that do not hold kernel text are mapped
+	// with a single huge page each.
+	for (uint64_t pa = 0; pa < mem_end; ) {
 		uint64_t va = (uint64_t) ptov(pa);
 
 		perm = PTE_P | PTE_W;
+		if (huge_pages && hpg_ofs (pa) == 0 && pa + HPGSIZE <= mem_end
+				&& (va + HPGSIZE <= (uint64_t) &start
+					|| va >= (uint64_t) &_end_kernel_text)) {
+			if ((pte = pml4e_walk_huge (pml4, va, 1)) != NULL)
+				*pte = pa | perm | PTE_PS;
+			pa += HPGSIZE;
+			continue;
+		}
+
 		if ((uint64_t) &start <= va && va < (uint64_t) &_end_kernel_text)
 			perm &= ~PTE_W;
 
 		if ((pte = pml4e_walk (pml4, va, 1)) != NULL)
 			*pte = pa | perm;
+		pa += PGSIZE;
 	}
 
 	// reload cr3
 	pml4_activate(0);
+	pcid_init ();
 }
 
 /* Breaks the kernel command line into words and returns them as
@@ -221,6 +246,33 @@ parse_options (char **argv) {
 			random_init (atoi (value));
 		else if (!strcmp (name, "-mlfqs"))
 			thread_mlfqs = true;
+		else if (!strcmp (name, "-memprof"))
+			memprof_enabled = true;
+		else if (!strcmp (name, "-nohuge"))
+			huge_pages = false;
+		else if (!strcmp (name, "-nopcid"))
+			pcid_allowed = false;
+#ifdef VM
+		else if (!strcmp (name, "-fault-around"))
+			fault_around_pages = atoi (value);
+		else if (!strcmp (name, "-ksm"))
+			ksm_enabled = true;
+		else if (!strcmp (name, "-nokswapd"))
+			kswapd_enabled = false;
+		else if (!strcmp (name, "-flush"))
+			flush_interval = atoi (value);
+		else if (!strcmp (name, "-zswap"))
+			zswap_percent = atoi (value);
+		else if (!strcmp (name, "-replace")) {
+			if (value != NULL && !strcmp (value, "2q"))
+				evict_policy = EVICT_2Q;
+			else if (value != NULL && !strcmp (value, "clock"))
+				evict_policy = EVICT_CLOCK;
+			else
+				PANIC ("unknown replacement policy `%s'", value);
+		} else if (!strcmp (name, "-faultstats"))
+			fault_stats = true;
+#endif
 #ifdef USERPROG
 		else if (!strcmp (name, "-ul"))
 			user_page_limit = atoi (value);
@@ -326,8 +378,20 @@ usage (void) {
 			"  -f                 Format file system disk during startup.\n"
 			"  -rs=SEED           Set random number seed to SEED.\n"
 			"  -mlfqs             Use multi-level feedback queue scheduler.\n"
+			"  -memprof           Report kernel allocations by call site.\n"
+			"  -nohuge            Map memory with 4 kB pages only.\n"
+			"  -nopcid            Flush the TLB on every address space switch.\n"
 #ifdef USERPROG
 			"  -ul=COUNT          Limit user memory to COUNT pages.\n"
+#endif
+#ifdef VM
+			"  -fault-around=N    Map up to N file pages per fault (1 disables).\n"
+			"  -ksm               Merge identical anonymous pages in the background.\n"
+			"  -nokswapd          Evict only when a fault finds no free frame.\n"
+			"  -flush=TICKS       Write back dirty mmap pages every TICKS (0 disables).\n"
+			"  -zswap=PERCENT     Keep up to PERCENT%% of user memory as compressed swap.\n"
+			"  -replace=POLICY    Replace frames by `clock' (default) or `2q'.\n"
+			"  -faultstats        Report each process's major faults at exit.\n"
 #endif
 			);
 	power_off ();
@@ -354,6 +418,9 @@ static void
 print_stats (void) {
 	timer_print_stats ();
 	thread_print_stats ();
+	palloc_print_stats ();
+	mmu_print_stats ();
+	memprof_print_stats ();
 #ifdef FILESYS
 	disk_print_stats ();
 #endif
@@ -362,4 +429,7 @@ print_stats (void) {
 #ifdef USERPROG
 	exception_print_stats ();
 #endif
+#ifdef VM
+	vm_print_stats ();
+#endif
 }
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/memprof.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
@@ -24,9 +25,13 @@
    list.  Then we return one of the new blocks.
 
    When we free a block, we add it to its descriptor's free list.
-   But if the arena that the block was in now has no in-use
-   blocks, we remove all of the arena's blocks from the free list
-   and give the arena back to the page allocator.
+   If the arena that the block was in now has no in-use blocks,
+   it is left parked on the free list, up to EMPTY_MAX arenas per
+   descriptor, so that alloc/free churn does not bounce pages
+   through the page allocator.  Past that limit, or when the page
+   allocator runs short and calls our shrinker, we remove all of
+   the arena's blocks from the free list and give the arena back
+   to the page allocator.
 
    We can't handle blocks bigger than 2 kB using this scheme,
    because they're too big to fit in a single page with a
@@ -40,8 +45,12 @@ struct desc {
 	size_t blocks_per_arena;    /* Number of blocks in an arena. */
 	struct list free_list;      /* List of free blocks. */
 	struct lock lock;           /* Lock. */
+	size_t empty_cnt;           /* Parked arenas with no blocks in use. */
 };
 
+/* Maximum number of empty arenas parked per descriptor. */
+#define EMPTY_MAX 8
+
 /* Magic number for detecting arena corruption. */
 #define ARENA_MAGIC 0x9a548eed
 
@@ -61,8 +70,22 @@ struct block {
 static struct desc descs[10];   /* Descriptors. */
 static size_t desc_cnt;         /* Number of descriptors. */
 
+static void *do_malloc (size_t);
 static struct arena *block_to_arena (struct block *);
 static struct block *arena_to_block (struct arena *, size_t idx);
+static void release_arena (struct arena *);
+static size_t malloc_shrink_count (void);
+static size_t malloc_shrink_scan (size_t page_cnt);
+
+/* Gives parked arenas back when the kernel pool runs dry.  They
+   cost nothing to rebuild, so they go first. */
+static struct shrinker malloc_shrinker = {
+	.name = "malloc",
+	.priority = 0,
+	.user = false,
+	.count = malloc_shrink_count,
+	.scan = malloc_shrink_scan,
+};
 
 /* Initializes the malloc() descriptors. */
 void
@@ -76,13 +99,27 @@ malloc_init (void) {
 		d->blocks_per_arena = (PGSIZE - sizeof (struct arena)) / block_size;
 		list_init (&d->free_list);
 		lock_init (&d->lock);
+		d->empty_cnt = 0;
 	}
+	palloc_register_shrinker (&malloc_shrinker);
 }
 
 /* Obtains and returns a new block of at least SIZE bytes.
    Returns a null pointer if memory is not available. */
 void *
 malloc (size_t size) {
+	void *p = do_malloc (size);
+
+	if (memprof_enabled)
+		memprof_alloc (__builtin_return_address (0), p, size);
+	return p;
+}
+
+/* Does the work of malloc() without charging the block to a call
+   site, so that calloc() and realloc() can charge their own
+   callers. */
+static void *
+do_malloc (size_t size) {
 	struct desc *d;
 	struct block *b;
 	struct arena *a;
@@ -100,7 +137,7 @@ malloc (size_t size) {
 		/* SIZE is too big for any descriptor.
 		   Allocate enough pages to hold SIZE plus an arena. */
 		size_t page_cnt = DIV_ROUND_UP (size + sizeof *a, PGSIZE);
-		a = palloc_get_multiple (0, page_cnt);
+		a = palloc_get_multiple (PAL_NOPROF, page_cnt);
 		if (a == NULL)
 			return NULL;
 
@@ -119,7 +156,7 @@ malloc (size_t size) {
 		size_t i;
 
 		/* Allocate a page. */
-		a = palloc_get_page (0);
+		a = palloc_get_page (PAL_NOPROF);
 		if (a == NULL) {
 			lock_release (&d->lock);
 			return NULL;
@@ -133,12 +170,17 @@ malloc (size_t size) {
 			struct block *b = arena_to_block (a, i);
 			list_push_back (&d->free_list, &b->free_elem);
 		}
+
+		/* Count it as parked, like any empty arena, until the
+		   block below is taken from it. */
+		d->empty_cnt++;
 	}
 
 	/* Get a block from free list and return it. */
 	b = list_entry (list_pop_front (&d->free_list), struct block, free_elem);
 	a = block_to_arena (b);
-	a->free_cnt--;
+	if (a->free_cnt-- == d->blocks_per_arena)
+		d->empty_cnt--;
 	lock_release (&d->lock);
 	return b;
 }
@@ -156,9 +198,11 @@ calloc (size_t a, size_t b) {
 		return NULL;
 
 	/* Allocate and zero memory. */
-	p = malloc (size);
+	p = do_malloc (size);
 	if (p != NULL)
 		memset (p, 0, size);
+	if (memprof_enabled)
+		memprof_alloc (__builtin_return_address (0), p, size);
 
 	return p;
 }
@@ -185,7 +229,9 @@ realloc (void *old_block, size_t new_size) {
 		free (old_block);
 		return NULL;
 	} else {
-		void *new_block = malloc (new_size);
+		void *new_block = do_malloc (new_size);
+		if (memprof_enabled)
+			memprof_alloc (__builtin_return_address (0), new_block, new_size);
 		if (old_block != NULL && new_block != NULL) {
 			size_t old_size = block_size (old_block);
 			size_t min_size = new_size < old_size ? new_size : old_size;
@@ -200,6 +246,8 @@ realloc (void *old_block, size_t new_size) {
    malloc(), calloc(), or realloc(). */
 void
 free (void *p) {
+	if (memprof_enabled)
+		memprof_free (p);
 	if (p != NULL) {
 		struct block *b = p;
 		struct arena *a = block_to_arena (b);
@@ -218,16 +266,14 @@ free (void *p) {
 			/* Add block to free list. */
 			list_push_front (&d->free_list, &b->free_elem);
 
-			/* If the arena is now entirely unused, free it. */
+			/* If the arena is now entirely unused, park it, or
+			   free it if enough are parked already. */
 			if (++a->free_cnt >= d->blocks_per_arena) {
-				size_t i;
-
 				ASSERT (a->free_cnt == d->blocks_per_arena);
-				for (i = 0; i < d->blocks_per_arena; i++) {
-					struct block *b = arena_to_block (a, i);
-					list_remove (&b->free_elem);
-				}
-				palloc_free_page (a);
+				if (d->empty_cnt < EMPTY_MAX)
+					d->empty_cnt++;
+				else
+					release_arena (a);
 			}
 
 			lock_release (&d->lock);
@@ -239,6 +285,71 @@ free (void *p) {
 	}
 }
 
+/* Removes all of the blocks of empty arena A from its
+   descriptor's free list and frees A's page.  The descriptor's
+   lock must be held. */
+static void
+release_arena (struct arena *a) {
+	struct desc *d = a->desc;
+	size_t i;
+
+	ASSERT (lock_held_by_current_thread (&d->lock));
+	ASSERT (a->free_cnt == d->blocks_per_arena);
+
+	for (i = 0; i < d->blocks_per_arena; i++) {
+		struct block *b = arena_to_block (a, i);
+		list_remove (&b->free_elem);
+	}
+	palloc_free_page (a);
+}
+
+/* Shrinker callback: returns the number of parked arenas. */
+static size_t
+malloc_shrink_count (void) {
+	size_t cnt = 0;
+	struct desc *d;
+
+	for (d = descs; d < descs + desc_cnt; d++)
+		cnt += d->empty_cnt;
+	return cnt;
+}
+
+/* Shrinker callback: frees up to PAGE_CNT parked arenas and
+   returns the number freed.  The allocation that ran the pool dry
+   may be malloc() itself, holding a descriptor lock, so busy
+   descriptors are skipped rather than waited for. */
+static size_t
+malloc_shrink_scan (size_t page_cnt) {
+	size_t freed = 0;
+	struct desc *d;
+
+	for (d = descs; d < descs + desc_cnt && freed < page_cnt; d++) {
+		struct list_elem *e;
+
+		if (d->empty_cnt == 0 || !lock_try_acquire (&d->lock))
+			continue;
+
+		/* Releasing an arena unlinks blocks anywhere in the list,
+		   so start over from the front after each one. */
+		e = list_begin (&d->free_list);
+		while (d->empty_cnt > 0 && freed < page_cnt
+				&& e != list_end (&d->free_list)) {
+			struct arena *a
+				= block_to_arena (list_entry (e, struct block, free_elem));
+
+			if (a->free_cnt == d->blocks_per_arena) {
+				release_arena (a);
+				d->empty_cnt--;
+				freed++;
+				e = list_begin (&d->free_list);
+			} else
+				e = list_next (e);
+		}
+		lock_release (&d->lock);
+	}
+	return freed;
+}
+
 /* Returns the arena that block B is inside. */
 static struct arena *
 block_to_arena (struct block *b) {
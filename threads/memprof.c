@@ -0,0 +1,204 @@
+#include "threads/memprof.h"
+#include <debug.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "threads/interrupt.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* Allocation profiler.
+
+   When enabled with -memprof, malloc() and palloc_get_multiple()
+   report every block they hand out together with the return
+   address of their caller, and free() and palloc_free_multiple()
+   report every block they take back.  Blocks are charged to a
+   call site; each site keeps its live bytes, its allocation
+   count and the peak of its live bytes.  The busiest sites are
+   printed at power off.  malloc() gets its own pages with
+   PAL_NOPROF, so its blocks are charged once, to its callers.
+
+   Both tables live in pages taken straight from the page
+   allocator at boot, so a disabled profiler costs no memory and
+   the allocators only pay for a test of memprof_enabled.  The
+   tables are small enough that updates simply run with
+   interrupts disabled. */
+
+/* Number of distinct call sites tracked. */
+#define SITE_CNT 256
+
+/* Number of simultaneously live blocks tracked. */
+#define LIVE_CNT 16384
+
+/* Number of sites printed at power off. */
+#define TOP_CNT 10
+
+/* A call site. */
+struct site {
+	const void *caller;         /* Return address into the caller. */
+	size_t live_bytes;          /* Bytes currently allocated. */
+	size_t peak_bytes;          /* Maximum of LIVE_BYTES. */
+	size_t alloc_cnt;           /* Allocations ever made. */
+};
+
+/* A live block. */
+struct live {
+	const void *block;          /* Block, null if the slot is empty. */
+	size_t size;                /* Requested size in bytes. */
+	struct site *site;          /* Charged site. */
+};
+
+bool memprof_enabled;
+
+static struct site *sites;      /* SITE_CNT sites, open addressing. */
+static struct live *lives;      /* LIVE_CNT blocks, open addressing. */
+static size_t untracked_cnt;    /* Allocations dropped on a full table. */
+
+static size_t hash_ptr (const void *, size_t cnt);
+static struct site *site_lookup (const void *caller);
+
+/* Allocates the profiler's tables if profiling was requested.
+   Must be called right after palloc_init(). */
+void
+memprof_init (void) {
+	if (!memprof_enabled)
+		return;
+
+	sites = palloc_get_multiple (PAL_ASSERT | PAL_ZERO,
+			DIV_ROUND_UP (SITE_CNT * sizeof *sites, PGSIZE));
+	lives = palloc_get_multiple (PAL_ASSERT | PAL_ZERO,
+			DIV_ROUND_UP (LIVE_CNT * sizeof *lives, PGSIZE));
+}
+
+/* Charges BLOCK of SIZE bytes to the call site CALLER. */
+void
+memprof_alloc (const void *caller, const void *block, size_t size) {
+	enum intr_level old_level;
+	struct site *site;
+	size_t start, i;
+
+	if (lives == NULL || block == NULL)
+		return;
+
+	old_level = intr_disable ();
+	site = site_lookup (caller);
+	start = i = hash_ptr (block, LIVE_CNT);
+	while (lives[i].block != NULL && (i = (i + 1) % LIVE_CNT) != start)
+		continue;
+	if (site == NULL || lives[i].block != NULL)
+		untracked_cnt++;
+	else {
+		lives[i] = (struct live) { block, size, site };
+		site->alloc_cnt++;
+		site->live_bytes += size;
+		if (site->live_bytes > site->peak_bytes)
+			site->peak_bytes = site->live_bytes;
+	}
+	intr_set_level (old_level);
+}
+
+/* Takes BLOCK off the call site it was charged to, if any. */
+void
+memprof_free (const void *block) {
+	enum intr_level old_level;
+	size_t start, i, j;
+
+	if (lives == NULL || block == NULL)
+		return;
+
+	old_level = intr_disable ();
+	start = i = hash_ptr (block, LIVE_CNT);
+	while (lives[i].block != NULL && lives[i].block != block
+			&& (i = (i + 1) % LIVE_CNT) != start)
+		continue;
+
+	if (lives[i].block == block) {
+		lives[i].site->live_bytes -= lives[i].size;
+		lives[i].block = NULL;
+
+		/* Shift later members of the probe run back so lookups
+		   never stop early at the hole we just made. */
+		for (j = (i + 1) % LIVE_CNT; lives[j].block != NULL;
+				j = (j + 1) % LIVE_CNT) {
+			size_t home = hash_ptr (lives[j].block, LIVE_CNT);
+			if ((j > i && (home <= i || home > j))
+					|| (j < i && home <= i && home > j)) {
+				lives[i] = lives[j];
+				lives[j].block = NULL;
+				i = j;
+			}
+		}
+	}
+	intr_set_level (old_level);
+}
+
+/* Prints the call sites holding the most memory, busiest first.
+   The addresses can be fed to the `backtrace' utility to turn
+   them into function names and line numbers. */
+void
+memprof_print_stats (void) {
+	struct site *top[TOP_CNT];
+	size_t top_cnt = 0;
+	size_t i, j;
+
+	if (sites == NULL)
+		return;
+
+	for (i = 0; i < SITE_CNT; i++) {
+		struct site *s = &sites[i];
+		if (s->caller == NULL)
+			continue;
+
+		/* Insertion into TOP, ordered by live then peak bytes. */
+		for (j = top_cnt; j > 0; j--) {
+			struct site *t = top[j - 1];
+			if (t->live_bytes > s->live_bytes
+					|| (t->live_bytes == s->live_bytes
+						&& t->peak_bytes >= s->peak_bytes))
+				break;
+			if (j < TOP_CNT)
+				top[j] = t;
+		}
+		if (j < TOP_CNT) {
+			top[j] = s;
+			if (top_cnt < TOP_CNT)
+				top_cnt++;
+		}
+	}
+
+	printf ("Memprof: top %zu allocation sites "
+			"(%zu allocations untracked):\n", top_cnt, untracked_cnt);
+	for (i = 0; i < top_cnt; i++)
+		printf ("  %p: %zu bytes live, %zu bytes peak, %zu allocations\n",
+				top[i]->caller, top[i]->live_bytes, top[i]->peak_bytes,
+				top[i]->alloc_cnt);
+	printf ("Memprof sites:");
+	for (i = 0; i < top_cnt; i++)
+		printf (" %p", top[i]->caller);
+	printf (".\n");
+}
+
+/* Returns a slot index in [0, CNT) for pointer P. */
+static size_t
+hash_ptr (const void *p, size_t cnt) {
+	return (((uintptr_t) p >> 4) * 0x9e3779b97f4a7c15ULL >> 32) % cnt;
+}
+
+/* Returns the site for CALLER, creating it if needed, or a null
+   pointer if every site is taken. */
+static struct site *
+site_lookup (const void *caller) {
+	size_t start = hash_ptr (caller, SITE_CNT);
+	size_t i = start;
+
+	do {
+		if (sites[i].caller == caller)
+			return &sites[i];
+		if (sites[i].caller == NULL) {
+			sites[i].caller = caller;
+			return &sites[i];
+		}
+		i = (i + 1) % SITE_CNT;
+	} while (i != start);
+	return NULL;
+}
@@ -1,13 +1,126 @@
 #include <stdbool.h>
+#include <round.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
+#include "threads/interrupt.h"
 #include "threads/pte.h"
 #include "threads/palloc.h"
+#include "threads/synch.h"
 #include "threads/thread.h"
 #include "threads/mmu.h"
 #include "intrinsic.h"
 
+/* Map memory with 2 MB pages where possible?  Cleared by the
+ * -nohuge kernel command line option. */
+bool huge_pages = true;
+
+/* Process-context identifiers.
+ *
+ * With CR4.PCIDE set, the low 12 bits of cr3 tag every TLB entry
+ * with the PCID of the address space that created it, and a cr3
+ * load with bit 63 set keeps the entries of all PCIDs.  Switching
+ * between processes then no longer refills the TLB from scratch.
+ *
+ * Each pml4 carries its PCID in PCID_SLOT, a slot of the upper,
+ * kernel half that no kernel mapping uses; the slot is never
+ * present, so the CPU ignores its other bits.  PCIDs are handed
+ * out in order and never freed individually.  When they run out,
+ * the generation is bumped, which invalidates every assignment at
+ * once.  The first cr3 load of a freshly assigned PCID flushes
+ * it, so whatever a previous owner left in the TLB is gone before
+ * the new one runs.  PCID 0 is base_pml4's.
+ *
+ * invlpg only reaches the current PCID, so a change to the
+ * mappings of an inactive pml4 marks it stale instead, and its
+ * next load flushes. */
+bool pcid_enabled;          /* PCIDs in use? */
+bool pcid_allowed = true;   /* Cleared by the -nopcid option. */
+
+#define PCID_SLOT 511                   /* pml4 slot holding the tag. */
+#define PCID_STALE 0x2                  /* Must flush on next load. */
+#define PCID_SHIFT 12                   /* PCID in bits 12...23. */
+#define PCID_MASK 0xfffUL
+#define PCID_GEN_SHIFT 24               /* Generation in bits 24...62. */
+#define CR3_NOFLUSH (1UL << 63)         /* Keep TLB entries on load. */
+#define CR4_PCIDE (1UL << 17)           /* CR4 PCID enable. */
+#define CPUID_PCID (1U << 17)           /* CPUID.1:ECX PCID support. */
+
+static uint64_t pcid_gen = 1;           /* Current generation. */
+static uint64_t pcid_next = 1;          /* Next PCID to hand out. */
+
+/* Statistics. */
+static long long pcid_kept;             /* cr3 loads that kept the TLB. */
+static long long pcid_flushed;          /* cr3 loads that flushed a PCID. */
+static long long pcid_rollovers;        /* Generations used up. */
+
+/* TLB gather statistics. */
+static long long gather_invlpgs;        /* Pages invalidated one by one. */
+static long long gather_full_flushes;   /* Flushes of a whole PCID. */
+static long long gather_tables;         /* Page tables freed. */
+
+/* Page-table page cache and lazy teardown.
+ *
+ * pml4 pages of dead address spaces are not freed but kept, with
+ * their user half cleared and the kernel half still in place, on
+ * PML4_CACHE, from which pml4_create() takes them without copying
+ * anything.  The "pml4-reaper" thread keeps the cache stocked.
+ *
+ * pml4_destroy_async() hands a dead pml4 to the reaper instead of
+ * walking and freeing it on the exiting thread.  Allocations that
+ * find a pool dry reap pending pml4s themselves through a
+ * shrinker, so deferring the work never makes memory run out.
+ *
+ * Both stacks are linked through PML4_LINK_SLOT, a never-present
+ * slot of the kernel half, and are protected by disabling
+ * interrupts. */
+#define PML4_LINK_SLOT 510              /* pml4 slot holding the link. */
+#define PML4_CACHE_MAX 16               /* Most pml4 pages cached. */
+#define PML4_CACHE_LOW 4                /* Reaper refills up to this. */
+
+static uint64_t *pml4_cache;            /* Clean pml4 pages. */
+static size_t pml4_cache_cnt;
+static uint64_t *pml4_dead;             /* pml4s awaiting teardown. */
+static size_t pml4_dead_cnt;
+static struct semaphore reaper_sema;    /* Upped when reaper has work. */
+static bool reaper_started;
+
+/* Statistics. */
+static long long pml4_cache_hits;       /* pml4_create() from cache. */
+static long long pml4_cache_misses;     /* pml4_create() from palloc. */
+static long long pml4_reaped;           /* Torn down by the reaper. */
+static long long pml4_reaped_sync;      /* Torn down by a shrinker. */
+
+static size_t pml4_teardown (uint64_t *pml4);
+static bool pml4_reap_one (size_t *page_cnt);
+
+static bool pml4_is_active (uint64_t *pml4);
+static void pml4_flush_page (uint64_t *pml4, const void *va);
+static bool pt_is_empty (const uint64_t *pt);
+
+/* Replaces the 2 MB mapping in page directory entry PDE by a page
+ * table mapping the same frames with 4 kB pages and the same
+ * permissions, so that part of it can be changed on its own.
+ * Returns false if the page table cannot be allocated. */
+static bool
+split_huge (uint64_t *pde) {
+	uint64_t *pt = palloc_get_page (0);
+	if (pt == NULL)
+		return false;
+
+	uint64_t pa = HPTE_ADDR (*pde);
+	uint64_t flags = *pde & PTE_FLAGS & ~PTE_PS;
+	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++)
+		pt[i] = (pa + i * PGSIZE) | flags;
+	*pde = vtop (pt) | PTE_U | PTE_W | PTE_P;
+	return true;
+}
+
+/* Returns the address of the page table entry for VA in page
+ * directory PDP.  If VA is covered by a 2 MB mapping, the page
+ * directory entry itself is returned, unless CREATE is set, in
+ * which case the mapping is split into 4 kB pages first. */
 static uint64_t *
 pgdir_walk (uint64_t *pdp, const uint64_t va, int create) {
 	int idx = PDX (va);
@@ -22,6 +135,11 @@ pgdir_walk (uint64_t *pdp, const uint64_t va, int create) {
 					return NULL;
 			} else
 				return NULL;
+		} else if (is_huge_pte (&pdp[idx])) {
+			if (!create)
+				return &pdp[idx];
+			if (!split_huge (&pdp[idx]))
+				return NULL;
 		}
 		return (uint64_t *) ptov (PTE_ADDR (pdp[idx]) + 8 * PTX (va));
 	}
@@ -88,13 +206,73 @@ pml4e_walk (uint64_t *pml4e, const uint64_t va, int create) {
 	return pte;
 }
 
+/* Returns the address of the page directory entry for the 2 MB
+ * region containing virtual address VA in page map level 4 PML4.
+ * If the upper levels are missing, behavior depends on CREATE, as
+ * for pml4e_walk(). */
+uint64_t *
+pml4e_walk_huge (uint64_t *pml4, const uint64_t va, int create) {
+	uint64_t *table = pml4;
+	int idx[] = { PML4 (va), PDPE (va) };
+
+	for (unsigned level = 0; level < sizeof idx / sizeof *idx; level++) {
+		uint64_t *entry = &table[idx[level]];
+		if (!(*entry & PTE_P)) {
+			uint64_t *new_page;
+			if (!create || (new_page = palloc_get_page (PAL_ZERO)) == NULL)
+				return NULL;
+			*entry = vtop (new_page) | PTE_U | PTE_W | PTE_P;
+		}
+		table = ptov (PTE_ADDR (*entry));
+	}
+	return &table[PDX (va)];
+}
+
+/* Pushes PML4 on the stack at *TOP holding *CNT pages.
+ * Interrupts must be off. */
+static void
+pml4_push (uint64_t **top, size_t *cnt, uint64_t *pml4) {
+	ASSERT (intr_get_level () == INTR_OFF);
+	pml4[PML4_LINK_SLOT] = (uint64_t) *top;
+	*top = pml4;
+	(*cnt)++;
+}
+
+/* Pops a pml4 off the stack at *TOP holding *CNT pages, or returns
+ * a null pointer if it is empty.  Interrupts must be off. */
+static uint64_t *
+pml4_pop (uint64_t **top, size_t *cnt) {
+	uint64_t *pml4 = *top;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	if (pml4 != NULL) {
+		*top = (uint64_t *) pml4[PML4_LINK_SLOT];
+		pml4[PML4_LINK_SLOT] = base_pml4[PML4_LINK_SLOT];
+		(*cnt)--;
+	}
+	return pml4;
+}
+
 /* Creates a new page map level 4 (pml4) has mappings for kernel
  * virtual addresses, but none for user virtual addresses.
  * Returns the new page directory, or a null pointer if memory
  * allocation fails. */
 uint64_t *
 pml4_create (void) {
-	uint64_t *pml4 = palloc_get_page (0);
+	enum intr_level old_level = intr_disable ();
+	uint64_t *pml4 = pml4_pop (&pml4_cache, &pml4_cache_cnt);
+	bool low = pml4_cache_cnt < PML4_CACHE_LOW;
+	intr_set_level (old_level);
+
+	if (low && reaper_started)
+		sema_up (&reaper_sema);
+	if (pml4 != NULL) {
+		pml4_cache_hits++;
+		return pml4;
+	}
+
+	pml4_cache_misses++;
+	pml4 = palloc_get_page (0);
 	if (pml4)
 		memcpy (pml4, base_pml4, PGSIZE);
 	return pml4;
@@ -122,10 +300,17 @@ pgdir_for_each (uint64_t *pdp, pte_for_each_func *func, void *aux,
 		unsigned pml4_index, unsigned pdp_index) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
-			if (!pt_for_each ((uint64_t *) PTE_ADDR (pte), func, aux,
-					pml4_index, pdp_index, i))
+		if (!(((uint64_t) pte) & PTE_P))
+			continue;
+		if (is_huge_pte (&pdp[i])) {
+			void *va = (void *) (((uint64_t) pml4_index << PML4SHIFT) |
+								 ((uint64_t) pdp_index << PDPESHIFT) |
+								 ((uint64_t) i << PDXSHIFT));
+			if (!func (&pdp[i], va, aux))
 				return false;
+		} else if (!pt_for_each ((uint64_t *) PTE_ADDR (pte), func, aux,
+					pml4_index, pdp_index, i))
+			return false;
 	}
 	return true;
 }
@@ -143,7 +328,9 @@ pdp_for_each (uint64_t *pdp,
 	return true;
 }
 
-/* Apply FUNC to each available pte entries including kernel's. */
+/* Apply FUNC to each available pte entries including kernel's.
+ * A 2 MB mapping is passed as its page directory entry, with
+ * is_huge_pte() true, once for the whole region. */
 bool
 pml4_for_each (uint64_t *pml4, pte_for_each_func *func, void *aux) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
@@ -155,34 +342,80 @@ pml4_for_each (uint64_t *pml4, pte_for_each_func *func, void *aux) {
 	return true;
 }
 
-static void
+/* The *_destroy() functions free a page table level and all the
+ * pages it references, and return the number of pages freed. */
+static size_t
 pt_destroy (uint64_t *pt) {
+	size_t cnt = 1;
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pt[i]);
-		if (((uint64_t) pte) & PTE_P)
+		if (((uint64_t) pte) & PTE_P) {
 			palloc_free_page ((void *) PTE_ADDR (pte));
+			cnt++;
+		}
 	}
 	palloc_free_page ((void *) pt);
+	return cnt;
 }
 
-static void
+static size_t
 pgdir_destroy (uint64_t *pdp) {
+	size_t cnt = 1;
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
-			pt_destroy (PTE_ADDR (pte));
+		if (!(((uint64_t) pte) & PTE_P))
+			continue;
+		if (is_huge_pte (&pdp[i])) {
+			palloc_free_huge (ptov (HPTE_ADDR (pdp[i])));
+			cnt += HPGSIZE / PGSIZE;
+		} else
+			cnt += pt_destroy (PTE_ADDR (pte));
 	}
 	palloc_free_page ((void *) pdp);
+	return cnt;
 }
 
-static void
+static size_t
 pdpe_destroy (uint64_t *pdpe) {
+	size_t cnt = 1;
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pde = ptov((uint64_t *) pdpe[i]);
 		if (((uint64_t) pde) & PTE_P)
-			pgdir_destroy ((void *) PTE_ADDR (pde));
+			cnt += pgdir_destroy ((void *) PTE_ADDR (pde));
 	}
 	palloc_free_page ((void *) pdpe);
+	return cnt;
+}
+
+/* Frees everything PML4 maps in its user half, then returns the
+ * pml4 page itself to the cache, or to palloc if the cache is
+ * full.  Returns the number of pages freed. */
+static size_t
+pml4_teardown (uint64_t *pml4) {
+	size_t cnt = 0;
+	enum intr_level old_level;
+
+	/* if PML4 (vaddr) >= 1, it's kernel space by define. */
+	uint64_t *pdpe = ptov ((uint64_t *) pml4[0]);
+	if (((uint64_t) pdpe) & PTE_P)
+		cnt += pdpe_destroy ((void *) PTE_ADDR (pdpe));
+
+	/* Back to what pml4_create() copied; this also drops the
+	 * PCID, so the page's next user gets a fresh one. */
+	pml4[0] = base_pml4[0];
+	pml4[PCID_SLOT] = base_pml4[PCID_SLOT];
+
+	old_level = intr_disable ();
+	if (pml4_cache_cnt < PML4_CACHE_MAX) {
+		pml4_push (&pml4_cache, &pml4_cache_cnt, pml4);
+		pml4 = NULL;
+	}
+	intr_set_level (old_level);
+	if (pml4 != NULL) {
+		palloc_free_page ((void *) pml4);
+		cnt++;
+	}
+	return cnt;
 }
 
 /* Destroys pml4e, freeing all the pages it references. */
@@ -191,19 +424,222 @@ pml4_destroy (uint64_t *pml4) {
 	if (pml4 == NULL)
 		return;
 	ASSERT (pml4 != base_pml4);
+	pml4_teardown (pml4);
+}
 
-	/* if PML4 (vaddr) >= 1, it's kernel space by define. */
-	uint64_t *pdpe = ptov ((uint64_t *) pml4[0]);
-	if (((uint64_t) pdpe) & PTE_P)
-		pdpe_destroy ((void *) PTE_ADDR (pdpe));
-	palloc_free_page ((void *) pml4);
+/* Like pml4_destroy(), but leaves the work to the reaper thread
+ * so that the caller does not pay for the size of the address
+ * space.  PML4 must not be active. */
+void
+pml4_destroy_async (uint64_t *pml4) {
+	enum intr_level old_level;
+
+	if (pml4 == NULL)
+		return;
+	ASSERT (pml4 != base_pml4);
+	ASSERT (!pml4_is_active (pml4));
+
+	if (!reaper_started) {
+		pml4_teardown (pml4);
+		return;
+	}
+	old_level = intr_disable ();
+	pml4_push (&pml4_dead, &pml4_dead_cnt, pml4);
+	intr_set_level (old_level);
+	sema_up (&reaper_sema);
+}
+
+/* Tears down one pml4 waiting for the reaper, adding the number of
+ * pages freed to *PAGE_CNT.  Returns false if none was waiting. */
+static bool
+pml4_reap_one (size_t *page_cnt) {
+	enum intr_level old_level = intr_disable ();
+	uint64_t *pml4 = pml4_pop (&pml4_dead, &pml4_dead_cnt);
+	intr_set_level (old_level);
+
+	if (pml4 == NULL)
+		return false;
+	*page_cnt += pml4_teardown (pml4);
+	return true;
+}
+
+/* The reaper thread: tears down dead address spaces and keeps the
+ * pml4 cache stocked. */
+static void
+pml4_reaper (void *aux UNUSED) {
+	for (;;) {
+		size_t cnt = 0;
+
+		sema_down (&reaper_sema);
+		while (pml4_reap_one (&cnt))
+			pml4_reaped++;
+
+		while (pml4_cache_cnt < PML4_CACHE_LOW) {
+			uint64_t *pml4 = palloc_get_page (0);
+			enum intr_level old_level;
+
+			if (pml4 == NULL)
+				break;
+			memcpy (pml4, base_pml4, PGSIZE);
+			old_level = intr_disable ();
+			pml4_push (&pml4_cache, &pml4_cache_cnt, pml4);
+			intr_set_level (old_level);
+		}
+	}
+}
+
+/* Shrinker callback: returns the number of pml4 pages that are
+ * waiting for the reaper or cached. */
+static size_t
+pml4_shrink_count (void) {
+	return pml4_dead_cnt + pml4_cache_cnt;
+}
+
+/* Shrinker callback: tears down waiting pml4s, then frees cached
+ * pml4 pages, until PAGE_CNT pages have been freed. */
+static size_t
+pml4_shrink_scan (size_t page_cnt) {
+	size_t cnt = 0;
+
+	while (cnt < page_cnt && pml4_reap_one (&cnt))
+		pml4_reaped_sync++;
+	while (cnt < page_cnt) {
+		enum intr_level old_level = intr_disable ();
+		uint64_t *pml4 = pml4_pop (&pml4_cache, &pml4_cache_cnt);
+		intr_set_level (old_level);
+
+		if (pml4 == NULL)
+			break;
+		palloc_free_page (pml4);
+		cnt++;
+	}
+	return cnt;
+}
+
+/* A dead address space holds both kernel pages (its page tables)
+ * and user pages (its frames), so one shrinker per pool. */
+static struct shrinker pml4_kernel_shrinker = {
+	.name = "pml4 (kernel)",
+	.priority = 0,
+	.user = false,
+	.count = pml4_shrink_count,
+	.scan = pml4_shrink_scan,
+};
+static struct shrinker pml4_user_shrinker = {
+	.name = "pml4 (user)",
+	.priority = 0,
+	.user = true,
+	.count = pml4_shrink_count,
+	.scan = pml4_shrink_scan,
+};
+
+/* Starts the reaper thread and stocks the pml4 cache.  Until this
+ * is called, pml4_destroy_async() works synchronously. */
+void
+pml4_reaper_start (void) {
+	sema_init (&reaper_sema, 1);
+	palloc_register_shrinker (&pml4_kernel_shrinker);
+	palloc_register_shrinker (&pml4_user_shrinker);
+	if (thread_create ("pml4-reaper", PRI_DEFAULT, pml4_reaper, NULL)
+			!= TID_ERROR)
+		reaper_started = true;
+}
+
+/* Turns on PCIDs if the CPU supports them and the -nopcid option
+ * was not given.  Must be called with base_pml4 active, because
+ * CR4.PCIDE can only be set while the current PCID is 0. */
+void
+pcid_init (void) {
+	if (!pcid_allowed || !(cpuid_ecx (1) & CPUID_PCID))
+		return;
+	ASSERT (PTE_ADDR (rcr3 ()) == vtop (base_pml4));
+	ASSERT (!(base_pml4[PCID_SLOT] & PTE_P));
+	lcr4 (rcr4 () | CR4_PCIDE);
+	pcid_enabled = true;
+}
+
+/* Returns the PCID and flush bit to load into cr3 along with
+ * PML4, handing PML4 a new PCID if it has none in the current
+ * generation.  Interrupts must be off. */
+static uint64_t
+pcid_cr3_bits (uint64_t *pml4) {
+	uint64_t tag = pml4[PCID_SLOT];
+	bool flush = false;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	if (pml4 == base_pml4)
+		return CR3_NOFLUSH;
+
+	if ((tag >> PCID_GEN_SHIFT) != pcid_gen) {
+		if (pcid_next > PCID_MASK) {
+			pcid_gen++;
+			pcid_next = 1;
+			pcid_rollovers++;
+		}
+		tag = (pcid_gen << PCID_GEN_SHIFT) | (pcid_next++ << PCID_SHIFT);
+		flush = true;
+	} else if (tag & PCID_STALE) {
+		tag &= ~PCID_STALE;
+		flush = true;
+	}
+	pml4[PCID_SLOT] = tag;
+
+	if (flush)
+		pcid_flushed++;
+	else
+		pcid_kept++;
+	return ((tag >> PCID_SHIFT) & PCID_MASK) | (flush ? 0 : CR3_NOFLUSH);
 }
 
 /* Loads page directory PD into the CPU's page directory base
  * register. */
 void
 pml4_activate (uint64_t *pml4) {
-	lcr3 (vtop (pml4 ? pml4 : base_pml4));
+	if (pml4 == NULL)
+		pml4 = base_pml4;
+
+	if (pcid_enabled) {
+		enum intr_level old_level = intr_disable ();
+		lcr3 (vtop (pml4) | pcid_cr3_bits (pml4));
+		intr_set_level (old_level);
+	} else
+		lcr3 (vtop (pml4));
+}
+
+/* Returns true if PML4 is the page table the CPU is using. */
+static bool
+pml4_is_active (uint64_t *pml4) {
+	return PTE_ADDR (rcr3 ()) == vtop (pml4);
+}
+
+/* Drops any TLB entry for VA in PML4, right away if PML4 is
+ * active and otherwise on its next activation.  A null VA stands
+ * for every address. */
+static void
+pml4_flush_page (uint64_t *pml4, const void *va) {
+	if (pml4_is_active (pml4)) {
+		if (va != NULL)
+			invlpg ((uint64_t) va);
+		else
+			lcr3 (rcr3 () & ~CR3_NOFLUSH);
+	} else if (pcid_enabled)
+		pml4[PCID_SLOT] |= PCID_STALE;
+}
+
+/* Prints PCID and TLB gather statistics. */
+void
+mmu_print_stats (void) {
+	if (pcid_enabled)
+		printf ("PCID: %lld switches kept the TLB, %lld flushed, "
+				"%lld generations recycled\n",
+				pcid_kept, pcid_flushed, pcid_rollovers);
+	printf ("TLB gather: %lld invlpgs, %lld full flushes, "
+			"%lld page tables freed\n",
+			gather_invlpgs, gather_full_flushes, gather_tables);
+	printf ("Pml4 cache: %lld hits, %lld misses; "
+			"%lld reaped by reaper, %lld by shrinker\n",
+			pml4_cache_hits, pml4_cache_misses,
+			pml4_reaped, pml4_reaped_sync);
 }
 
 /* Looks up the physical address that corresponds to user virtual
@@ -216,8 +652,11 @@ pml4_get_page (uint64_t *pml4, const void *uaddr) {
 
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) uaddr, 0);
 
-	if (pte && (*pte & PTE_P))
+	if (pte && (*pte & PTE_P)) {
+		if (is_huge_pte (pte))
+			return ptov (HPTE_ADDR (*pte)) + hpg_ofs (uaddr);
 		return ptov (PTE_ADDR (*pte)) + pg_ofs (uaddr);
+	}
 	return NULL;
 }
 
@@ -243,6 +682,36 @@ pml4_set_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
 	return pte != NULL;
 }
 
+/* Adds a mapping in PML4 from the 2 MB user virtual region at
+ * UPAGE to the huge frame at kernel virtual address KPAGE, which
+ * should come from palloc_get_huge().  Both must be aligned to
+ * HPGSIZE and nothing in the region may be mapped yet.  RW is as
+ * for pml4_set_page().  Returns true if successful, false if the
+ * region is in use or memory allocation failed. */
+bool
+pml4_set_huge_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
+	ASSERT (hpg_ofs (upage) == 0);
+	ASSERT (hpg_ofs (kpage) == 0);
+	ASSERT (is_user_vaddr (upage));
+	ASSERT (pml4 != base_pml4);
+
+	uint64_t *pde = pml4e_walk_huge (pml4, (uint64_t) upage, 1);
+	if (pde == NULL)
+		return false;
+	if (*pde & PTE_P) {
+		/* An empty page table left behind by earlier 4 kB mappings
+		 * can be reclaimed; anything else is a conflict. */
+		uint64_t *pt = ptov (PTE_ADDR (*pde));
+		if (is_huge_pte (pde) || !pt_is_empty (pt))
+			return false;
+		*pde = 0;
+		pml4_flush_page (pml4, NULL);
+		palloc_free_page (pt);
+	}
+	*pde = vtop (kpage) | PTE_P | PTE_PS | (rw ? PTE_W : 0) | PTE_U;
+	return true;
+}
+
 /* Marks user virtual page UPAGE "not present" in page
  * directory PD.  Later accesses to the page will fault.  Other
  * bits in the page table entry are preserved.
@@ -255,10 +724,135 @@ pml4_clear_page (uint64_t *pml4, void *upage) {
 
 	pte = pml4e_walk (pml4, (uint64_t) upage, false);
 
+	/* Only UPAGE goes away, so a 2 MB mapping is split first. */
+	if (pte != NULL && is_huge_pte (pte)) {
+		if (!split_huge (pte))
+			PANIC ("pml4_clear_page: cannot split huge page");
+		pte = pml4e_walk (pml4, (uint64_t) upage, false);
+	}
+
 	if (pte != NULL && (*pte & PTE_P) != 0) {
 		*pte &= ~PTE_P;
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) upage);
+		pml4_flush_page (pml4, upage);
+	}
+}
+
+/* Starts gathering unmaps from PML4 into TLB. */
+void
+tlb_gather_init (struct tlb_gather *tlb, uint64_t *pml4) {
+	ASSERT (pml4 != base_pml4);
+	tlb->pml4 = pml4;
+	tlb->page_cnt = 0;
+	tlb->table_cnt = 0;
+}
+
+/* Records that the PAGE_CNT pages starting at VA were unmapped. */
+static void
+tlb_gather_pages (struct tlb_gather *tlb, void *va, size_t page_cnt) {
+	if (tlb->page_cnt < TLB_GATHER_PAGES && page_cnt == 1)
+		tlb->pages[tlb->page_cnt] = va;
+	tlb->page_cnt += page_cnt;
+}
+
+/* Records that page table PT was unhooked from TLB's pml4.  It
+ * can only be freed once no TLB entry or paging-structure cache
+ * entry can refer to it any more. */
+static void
+tlb_gather_table (struct tlb_gather *tlb, void *pt) {
+	if (tlb->table_cnt == TLB_GATHER_TABLES)
+		tlb_gather_finish (tlb);
+	tlb->tables[tlb->table_cnt++] = pt;
+}
+
+/* Invalidates the TLB entries for everything gathered in TLB,
+ * then frees the gathered page tables.  A few pages are dropped
+ * one invlpg at a time; past TLB_GATHER_PAGES, or once a page
+ * table went away, the whole address space is flushed instead.
+ * TLB may be used for more unmaps afterward. */
+void
+tlb_gather_finish (struct tlb_gather *tlb) {
+	size_t i;
+
+	if (tlb->page_cnt == 0 && tlb->table_cnt == 0)
+		return;
+
+	if (tlb->page_cnt > TLB_GATHER_PAGES || tlb->table_cnt > 0) {
+		pml4_flush_page (tlb->pml4, NULL);
+		gather_full_flushes++;
+	} else {
+		for (i = 0; i < tlb->page_cnt; i++)
+			pml4_flush_page (tlb->pml4, tlb->pages[i]);
+		gather_invlpgs += tlb->page_cnt;
+	}
+
+	for (i = 0; i < tlb->table_cnt; i++)
+		palloc_free_page (tlb->tables[i]);
+	gather_tables += tlb->table_cnt;
+
+	tlb->page_cnt = 0;
+	tlb->table_cnt = 0;
+}
+
+/* Returns true if page table PT maps nothing. */
+static bool
+pt_is_empty (const uint64_t *pt) {
+	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++)
+		if (pt[i] & PTE_P)
+			return false;
+	return true;
+}
+
+/* Marks the PAGE_CNT user virtual pages starting at UPAGE "not
+ * present" in TLB's pml4, gathering the TLB invalidations into
+ * TLB; the caller must call tlb_gather_finish() before freeing
+ * the frames that were mapped there.  2 MB mappings that lie
+ * entirely inside the range are cleared whole, others are split.
+ *
+ * Unlike pml4_clear_page(), page tables left with nothing mapped
+ * are unhooked and freed, so the remaining bits of cleared PTEs
+ * may be lost: read dirty and accessed bits first. */
+void
+pml4_clear_range (struct tlb_gather *tlb, void *upage, size_t page_cnt) {
+	uint8_t *va = upage;
+	uint8_t *end = va + page_cnt * PGSIZE;
+
+	ASSERT (pg_ofs (upage) == 0);
+	ASSERT (is_user_vaddr (upage) && (page_cnt == 0 || is_user_vaddr (end - 1)));
+
+	while (va < end) {
+		uint8_t *next = (uint8_t *) ROUND_UP ((uint64_t) va + 1, HPGSIZE);
+		uint64_t *pde = pml4e_walk_huge (tlb->pml4, (uint64_t) va, 0);
+
+		if (next > end)
+			next = end;
+		if (pde == NULL || !(*pde & PTE_P)) {
+			va = next;
+			continue;
+		}
+
+		if (is_huge_pte (pde)) {
+			if (hpg_ofs (va) == 0 && next - va == HPGSIZE) {
+				*pde &= ~PTE_P;
+				tlb_gather_pages (tlb, va, HPGSIZE / PGSIZE);
+				va = next;
+				continue;
+			}
+			if (!split_huge (pde))
+				PANIC ("pml4_clear_range: cannot split huge page");
+		}
+
+		uint64_t *pt = ptov (PTE_ADDR (*pde));
+		for (; va < next; va += PGSIZE) {
+			uint64_t *pte = &pt[PTX (va)];
+			if (*pte & PTE_P) {
+				*pte &= ~PTE_P;
+				tlb_gather_pages (tlb, va, 1);
+			}
+		}
+		if (pt_is_empty (pt)) {
+			*pde = 0;
+			tlb_gather_table (tlb, pt);
+		}
 	}
 }
 
@@ -283,8 +877,7 @@ pml4_set_dirty (uint64_t *pml4, const void *vpage, bool dirty) {
 		else
 			*pte &= ~(uint32_t) PTE_D;
 
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) vpage);
+		pml4_flush_page (pml4, vpage);
 	}
 }
 
@@ -309,7 +902,23 @@ pml4_set_accessed (uint64_t *pml4, const void *vpage, bool accessed) {
 		else
 			*pte &= ~(uint32_t) PTE_A;
 
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) vpage);
+		pml4_flush_page (pml4, vpage);
 	}
 }
+
+/* Makes the present PTE for virtual page VPAGE in PML4 writable if
+ * WRITABLE is true, read-only otherwise, keeping its other bits.
+ * Returns false if PML4 does not map VPAGE. */
+bool
+pml4_set_writable (uint64_t *pml4, const void *vpage, bool writable) {
+	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
+
+	if (pte == NULL || !(*pte & PTE_P))
+		return false;
+	if (writable)
+		*pte |= PTE_W;
+	else
+		*pte &= ~(uint64_t) PTE_W;
+	pml4_flush_page (pml4, vpage);
+	return true;
+}
@@ -8,7 +8,9 @@
 #include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
+#include "threads/interrupt.h"
 #include "threads/loader.h"
+#include "threads/memprof.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
 
@@ -23,25 +25,99 @@
    even if user processes are swapping like mad.
 
    By default, half of system RAM is given to the kernel pool and
-   half to the user pool.  That should be huge overkill for the
-   kernel pool, but that's just fine for demonstration purposes. */
+   half to the user pool.  That is only the starting point: the
+   bitmaps of both pools span all of memory, with USER_OWNED
+   recording which pool each page currently belongs to, and a
+   pool that runs dry borrows a chunk of free pages from the other
+   one, as long as the lender keeps a quarter of its boot-time
+   size free.  The user pool never grows past user_page_limit.
+
+   Each pool also keeps a small stack of free pages that were
+   already zeroed by the idle thread (see palloc_zero_idle()).
+   Single-page PAL_ZERO requests are served from that stack
+   without touching the page.  Pages on the stack are marked used
+   in USED_MAP, so they are handed back to the bitmap whenever a
+   scan would otherwise fail.
+
+   Other kernel caches that hold pages they could give back
+   (malloc's empty arenas, for example) register a struct shrinker
+   with palloc_register_shrinker().  When a scan fails even after
+   draining the zeroed stack, the shrinkers of that pool are asked
+   to release pages, cheapest first, and the scan is retried
+   before the allocation is allowed to fail. */
+
+/* Maximum number of pre-zeroed pages parked per pool. */
+#define ZEROED_MAX 64
+
+/* Pages moved at once when one pool borrows from the other. */
+#define BORROW_CHUNK 256
+
+/* Number of pool occupancy samples kept for palloc_print_stats(),
+   and the initial sampling interval in timer ticks. */
+#define OCC_SAMPLES 16
+#define OCC_INTERVAL 100
 
 /* A memory pool. */
 struct pool {
 	struct lock lock;               /* Mutual exclusion. */
 	struct bitmap *used_map;        /* Bitmap of free pages. */
-	uint8_t *base;                  /* Base of pool. */
+	uint8_t *base;                  /* Base of all memory. */
+	size_t first;                   /* Lowest page index ever owned. */
+	size_t owned_cnt;               /* Pages currently owned. */
+	size_t free_cnt;                /* Owned pages free in USED_MAP. */
+	size_t reserve;                 /* Free pages never lent out. */
+	long long borrowed;             /* Pages borrowed from other pool. */
+
+	/* Pre-zeroed free pages, protected by disabling interrupts
+	   because the idle thread must never sleep on LOCK. */
+	void *zeroed;                   /* Stack of zeroed pages. */
+	size_t zeroed_cnt;              /* Pages on ZEROED. */
+	long long zero_hits;            /* PAL_ZERO served from ZEROED. */
+	long long zero_misses;          /* PAL_ZERO zeroed on demand. */
 };
 
 /* Two pools: one for kernel data, one for user pages. */
 static struct pool kernel_pool, user_pool;
 
+/* Pages owned by the user pool, indexed like the pool bitmaps.
+   Only changed by borrow_pages(), with both pages marked used. */
+static struct bitmap *user_owned;
+
+/* Pool occupancy history, in pages, sampled from the timer
+   interrupt.  When full, every other sample is dropped and the
+   interval doubles, so the history always covers the whole run. */
+struct occupancy {
+	int64_t ticks;                  /* Time of sample. */
+	size_t kernel_used, kernel_owned;
+	size_t user_used, user_owned;
+};
+static struct occupancy occ[OCC_SAMPLES];
+static size_t occ_cnt;
+static int64_t occ_interval = OCC_INTERVAL;
+
+/* Registered shrinkers, in ascending order of priority.
+   Registration happens during boot, so the list is only read
+   afterward. */
+static struct list shrinkers;
+
 /* Maximum number of pages to put in user pool. */
 size_t user_page_limit = SIZE_MAX;
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end);
 
 static bool page_from_pool (const struct pool *, void *page);
+static void *zeroed_pop (struct pool *);
+static void zeroed_push (struct pool *, void *page);
+static bool zeroed_drain (struct pool *);
+static void zero_pages (void *pages, size_t page_cnt);
+static void *get_pages (enum palloc_flags, size_t page_cnt);
+static size_t scan_aligned (struct pool *, size_t page_cnt);
+static size_t alloc_pages (struct pool *, size_t page_cnt, bool aligned);
+static size_t shrink_caches (struct pool *, size_t page_cnt);
+static bool borrow_pages (struct pool *, size_t page_cnt, bool aligned);
+static size_t pool_free_cnt (const struct pool *);
+static void pool_adjust (struct pool *, size_t owned, size_t free);
+static list_less_func shrinker_less;
 
 /* multiboot info */
 struct multiboot_info {
@@ -133,6 +209,7 @@ populate_pools (struct area *base_mem, struct area *ext_mem) {
 	enum { KERN_START, KERN, USER_START, USER } state = KERN_START;
 	uint64_t rem = kern_pages;
 	uint64_t region_start = 0, end = 0, start, size, size_in_pg;
+	uint64_t pools_start = 0;
 
 	struct multiboot_info *mb_info = ptov (MULTIBOOT_INFO);
 	struct e820_entry *entries = ptov (mb_info->mmap_base);
@@ -157,9 +234,8 @@ populate_pools (struct area *base_mem, struct area *ext_mem) {
 						rem -= size_in_pg;
 						break;
 					}
-					// generate kernel pool
-					init_pool (&kernel_pool,
-							&free_start, region_start, start + rem * PGSIZE);
+					// the kernel pool starts here
+					pools_start = region_start;
 					// Transition to the next state
 					if (rem == size_in_pg) {
 						rem = user_pages;
@@ -187,14 +263,20 @@ populate_pools (struct area *base_mem, struct area *ext_mem) {
 		}
 	}
 
-	// generate the user pool
-	init_pool(&user_pool, &free_start, region_start, end);
+	// generate both pools over all of memory; the user pool owns
+	// everything from REGION_START up.
+	init_pool (&kernel_pool, &free_start, pools_start, end);
+	init_pool (&user_pool, &free_start, pools_start, end);
+	size_t pgcnt = (end - pools_start) / PGSIZE;
+	size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (pgcnt), PGSIZE) * PGSIZE;
+	user_owned = bitmap_create_in_buf (pgcnt, free_start, bm_pages);
+	free_start += bm_pages;
+	size_t boundary = pg_no (region_start) - pg_no (pools_start);
+	bitmap_set_multiple (user_owned, boundary, pgcnt - boundary, true);
+	user_pool.first = boundary;
 
 	// Iterate over the e820_entry. Setup the usable.
 	uint64_t usable_bound = (uint64_t) free_start;
-	struct pool *pool;
-	void *pool_end;
-	size_t page_idx, page_cnt;
 
 	for (i = 0; i < mb_info->mmap_len / sizeof (struct e820_entry); i++) {
 		struct e820_entry *entry = &entries[i];
@@ -211,27 +293,25 @@ populate_pools (struct area *base_mem, struct area *ext_mem) {
 
 			start = (uint64_t)
 				pg_round_up (start >= usable_bound ? start : usable_bound);
-split:
-			if (page_from_pool (&kernel_pool, (void *) start))
-				pool = &kernel_pool;
-			else if (page_from_pool (&user_pool, (void *) start))
-				pool = &user_pool;
-			else
-				NOT_REACHED ();
-
-			pool_end = pool->base + bitmap_size (pool->used_map) * PGSIZE;
-			page_idx = pg_no (start) - pg_no (pool->base);
-			if ((uint64_t) pool_end < end) {
-				page_cnt = ((uint64_t) pool_end - start) / PGSIZE;
-				bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
-				start = (uint64_t) pool_end;
-				goto split;
-			} else {
-				page_cnt = ((uint64_t) end - start) / PGSIZE;
-				bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+
+			size_t lo = pg_no (start) - pg_no (pools_start);
+			size_t hi = pg_no (end) - pg_no (pools_start);
+			if (lo >= hi)
+				continue;
+			if (lo < boundary) {
+				size_t cnt = (hi < boundary ? hi : boundary) - lo;
+				bitmap_set_multiple (kernel_pool.used_map, lo, cnt, false);
+				pool_adjust (&kernel_pool, cnt, cnt);
+			}
+			if (hi > boundary) {
+				size_t first = lo > boundary ? lo : boundary;
+				bitmap_set_multiple (user_pool.used_map, first, hi - first, false);
+				pool_adjust (&user_pool, hi - first, hi - first);
 			}
 		}
 	}
+	kernel_pool.reserve = kernel_pool.owned_cnt / 4;
+	user_pool.reserve = user_pool.owned_cnt / 4;
 }
 
 /* Initializes the page allocator and get the memory size */
@@ -243,6 +323,7 @@ palloc_init (void) {
 	struct area base_mem = { .size = 0 };
 	struct area ext_mem = { .size = 0 };
 
+	list_init (&shrinkers);
 	resolve_area_info (&base_mem, &ext_mem);
 	printf ("Pintos booting with: \n");
 	printf ("\tbase_mem: 0x%llx ~ 0x%llx (Usable: %'llu kB)\n",
@@ -261,13 +342,30 @@ palloc_init (void) {
    FLAGS, in which case the kernel panics. */
 void *
 palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
-	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	void *pages = get_pages (flags, page_cnt);
 
-	lock_acquire (&pool->lock);
-	size_t page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
-	lock_release (&pool->lock);
+	if (memprof_enabled && !(flags & PAL_NOPROF))
+		memprof_alloc (__builtin_return_address (0), pages, PGSIZE * page_cnt);
+	return pages;
+}
+
+/* Does the work of palloc_get_multiple() without charging the
+   pages to a call site. */
+static void *
+get_pages (enum palloc_flags flags, size_t page_cnt) {
+	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
 	void *pages;
 
+	if (flags & PAL_ZERO) {
+		pages = page_cnt == 1 ? zeroed_pop (pool) : NULL;
+		if (pages != NULL) {
+			pool->zero_hits++;
+			return pages;
+		}
+		pool->zero_misses++;
+	}
+
+	size_t page_idx = alloc_pages (pool, page_cnt, false);
 	if (page_idx != BITMAP_ERROR)
 		pages = pool->base + PGSIZE * page_idx;
 	else
@@ -275,7 +373,7 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
 
 	if (pages) {
 		if (flags & PAL_ZERO)
-			memset (pages, 0, PGSIZE * page_cnt);
+			zero_pages (pages, page_cnt);
 	} else {
 		if (flags & PAL_ASSERT)
 			PANIC ("palloc_get: out of pages");
@@ -293,7 +391,45 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
    FLAGS, in which case the kernel panics. */
 void *
 palloc_get_page (enum palloc_flags flags) {
-	return palloc_get_multiple (flags, 1);
+	void *page = get_pages (flags, 1);
+
+	if (memprof_enabled && !(flags & PAL_NOPROF))
+		memprof_alloc (__builtin_return_address (0), page, PGSIZE);
+	return page;
+}
+
+/* Obtains a huge page: HPGSIZE bytes of free memory whose
+   physical address is HPGSIZE-aligned, so that it can be mapped
+   by a single page directory entry.  The block is carved out of
+   the pool bitmap like a naturally aligned order-9 buddy, and is
+   given back to it with palloc_free_huge().  FLAGS are as for
+   palloc_get_multiple(). */
+void *
+palloc_get_huge (enum palloc_flags flags) {
+	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	size_t page_cnt = HPGSIZE / PGSIZE;
+	size_t page_idx = alloc_pages (pool, page_cnt, true);
+	void *pages;
+
+	if (page_idx != BITMAP_ERROR) {
+		pages = pool->base + PGSIZE * page_idx;
+		if (flags & PAL_ZERO)
+			zero_pages (pages, page_cnt);
+		if (memprof_enabled && !(flags & PAL_NOPROF))
+			memprof_alloc (__builtin_return_address (0), pages, HPGSIZE);
+	} else {
+		pages = NULL;
+		if (flags & PAL_ASSERT)
+			PANIC ("palloc_get_huge: out of huge pages");
+	}
+	return pages;
+}
+
+/* Frees the huge page at PAGES, obtained with palloc_get_huge(). */
+void
+palloc_free_huge (void *pages) {
+	ASSERT (hpg_ofs (pages) == 0);
+	palloc_free_multiple (pages, HPGSIZE / PGSIZE);
 }
 
 /* Frees the PAGE_CNT pages starting at PAGES. */
@@ -305,6 +441,8 @@ palloc_free_multiple (void *pages, size_t page_cnt) {
 	ASSERT (pg_ofs (pages) == 0);
 	if (pages == NULL || page_cnt == 0)
 		return;
+	if (memprof_enabled)
+		memprof_free (pages);
 
 	if (page_from_pool (&kernel_pool, pages))
 		pool = &kernel_pool;
@@ -320,6 +458,7 @@ palloc_free_multiple (void *pages, size_t page_cnt) {
 #endif
 	ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
 	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+	pool_adjust (pool, 0, page_cnt);
 }
 
 /* Frees the page at PAGE. */
@@ -328,6 +467,294 @@ palloc_free_page (void *page) {
 	palloc_free_multiple (page, 1);
 }
 
+/* Zeroes one free page ahead of demand, preferring the kernel
+   pool.  Called by the idle thread, so it never sleeps: if a
+   pool's lock is busy that pool is skipped.  Returns true if a
+   page was zeroed, false if there was nothing to do. */
+bool
+palloc_zero_idle (void) {
+	struct pool *pools[] = { &kernel_pool, &user_pool };
+
+	for (size_t i = 0; i < sizeof pools / sizeof *pools; i++) {
+		struct pool *pool = pools[i];
+		size_t page_idx;
+
+		if (pool->zeroed_cnt >= ZEROED_MAX
+				|| !lock_try_acquire (&pool->lock))
+			continue;
+		page_idx = bitmap_scan_and_flip (pool->used_map, pool->first, 1, false);
+		if (page_idx != BITMAP_ERROR)
+			pool_adjust (pool, 0, -1);
+		lock_release (&pool->lock);
+
+		if (page_idx != BITMAP_ERROR) {
+			void *page = pool->base + PGSIZE * page_idx;
+			zero_pages (page, 1);
+			zeroed_push (pool, page);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Returns the number of pages the user pool owns, which starts
+   out as its share of memory, within -ul, and changes as pages
+   are lent and borrowed. */
+size_t
+palloc_user_pages (void) {
+	size_t owned_cnt;
+
+	lock_acquire (&user_pool.lock);
+	owned_cnt = user_pool.owned_cnt;
+	lock_release (&user_pool.lock);
+	return owned_cnt;
+}
+
+/* Returns the number of pages a PAL_USER request could obtain
+   right now without any cache giving memory back: the user pool's
+   free and pre-zeroed pages, plus what it could still borrow from
+   the kernel pool.  Counts the bitmaps, so it is meant for
+   occasional polling rather than every allocation. */
+size_t
+palloc_user_free (void) {
+	size_t free_cnt, owned_cnt, lendable = 0, kernel_free;
+
+	lock_acquire (&user_pool.lock);
+	free_cnt = pool_free_cnt (&user_pool) + user_pool.zeroed_cnt;
+	owned_cnt = user_pool.owned_cnt;
+	lock_release (&user_pool.lock);
+
+	lock_acquire (&kernel_pool.lock);
+	kernel_free = pool_free_cnt (&kernel_pool);
+	if (kernel_free > kernel_pool.reserve)
+		lendable = kernel_free - kernel_pool.reserve;
+	lock_release (&kernel_pool.lock);
+
+	if (owned_cnt >= user_page_limit)
+		lendable = 0;
+	else if (lendable > user_page_limit - owned_cnt)
+		lendable = user_page_limit - owned_cnt;
+	return free_cnt + lendable;
+}
+
+/* Stores in *BASE and *PAGE_CNT the range of kernel virtual
+   pages that the user pool may ever own.  Since pages move
+   between pools, that is all of memory. */
+void
+palloc_user_span (void **base, size_t *page_cnt) {
+	*base = user_pool.base;
+	*page_cnt = bitmap_size (user_pool.used_map);
+}
+
+/* Records the occupancy of both pools if a sample is due at
+   TICKS.  Called from the timer interrupt, so it reads only the
+   counters that pool_adjust() keeps consistent. */
+void
+palloc_sample (int64_t ticks) {
+	struct occupancy *o;
+	size_t i;
+
+	if (user_owned == NULL || ticks % occ_interval != 0)
+		return;
+	if (occ_cnt == OCC_SAMPLES) {
+		/* Keep the samples at multiples of the doubled interval. */
+		for (i = 0; i < OCC_SAMPLES / 2; i++)
+			occ[i] = occ[2 * i + 1];
+		occ_cnt = OCC_SAMPLES / 2;
+		occ_interval *= 2;
+		if (ticks % occ_interval != 0)
+			return;
+	}
+
+	o = &occ[occ_cnt++];
+	o->ticks = ticks;
+	o->kernel_owned = kernel_pool.owned_cnt;
+	o->kernel_used = o->kernel_owned - kernel_pool.free_cnt;
+	o->user_owned = user_pool.owned_cnt;
+	o->user_used = o->user_owned - user_pool.free_cnt;
+}
+
+/* Registers S, whose NAME, PRIORITY, USER, COUNT and SCAN
+   members must already be set.  Shrinkers with a lower PRIORITY
+   are asked first, so cheap-to-rebuild caches should use low
+   values.  S must stay valid until shutdown. */
+void
+palloc_register_shrinker (struct shrinker *s) {
+	ASSERT (s != NULL && s->count != NULL && s->scan != NULL);
+
+	s->calls = s->reclaimed = 0;
+	list_insert_ordered (&shrinkers, &s->elem, shrinker_less, NULL);
+}
+
+/* Prints statistics about the pre-zeroed page pools, pool
+   rebalancing and occupancy, and the registered shrinkers. */
+void
+palloc_print_stats (void) {
+	struct list_elem *e;
+	size_t i;
+
+	printf ("Palloc: %lld zeroed-pool hits, %lld misses (kernel), "
+			"%lld hits, %lld misses (user)\n",
+			kernel_pool.zero_hits, kernel_pool.zero_misses,
+			user_pool.zero_hits, user_pool.zero_misses);
+	printf ("Palloc: kernel pool owns %zu pages (%lld borrowed), "
+			"user pool owns %zu pages (%lld borrowed)\n",
+			kernel_pool.owned_cnt, kernel_pool.borrowed,
+			user_pool.owned_cnt, user_pool.borrowed);
+	if (occ_cnt > 0)
+		printf ("Palloc occupancy, used/owned pages every %"PRId64" ticks:\n",
+				occ_interval);
+	for (i = 0; i < occ_cnt; i++)
+		printf ("  %6"PRId64": kernel %zu/%zu, user %zu/%zu\n",
+				occ[i].ticks, occ[i].kernel_used, occ[i].kernel_owned,
+				occ[i].user_used, occ[i].user_owned);
+	for (e = list_begin (&shrinkers); e != list_end (&shrinkers);
+			e = list_next (e)) {
+		struct shrinker *s = list_entry (e, struct shrinker, elem);
+		printf ("Shrinker %s: %lld calls, %lld pages reclaimed\n",
+				s->name, s->calls, s->reclaimed);
+	}
+}
+
+/* Orders shrinkers by ascending priority. */
+static bool
+shrinker_less (const struct list_elem *a_, const struct list_elem *b_,
+		void *aux UNUSED) {
+	const struct shrinker *a = list_entry (a_, struct shrinker, elem);
+	const struct shrinker *b = list_entry (b_, struct shrinker, elem);
+
+	return a->priority < b->priority;
+}
+
+/* Allocates PAGE_CNT contiguous pages from POOL, HPGSIZE-aligned
+   if ALIGNED, and returns the index of the first one, or
+   BITMAP_ERROR.  Before giving up, the zeroed stack is handed
+   back to the bitmap and then the pool's shrinkers are run until
+   the scan succeeds or they have nothing left to give. */
+static size_t
+alloc_pages (struct pool *pool, size_t page_cnt, bool aligned) {
+	size_t page_idx;
+
+	for (;;) {
+		lock_acquire (&pool->lock);
+		page_idx = aligned ? scan_aligned (pool, page_cnt)
+			: bitmap_scan_and_flip (pool->used_map, pool->first, page_cnt, false);
+		if (page_idx == BITMAP_ERROR && zeroed_drain (pool))
+			page_idx = aligned ? scan_aligned (pool, page_cnt)
+				: bitmap_scan_and_flip (pool->used_map, pool->first, page_cnt,
+						false);
+		if (page_idx != BITMAP_ERROR)
+			pool_adjust (pool, 0, -page_cnt);
+		lock_release (&pool->lock);
+
+		/* Borrowing and shrinkers run without the pool lock: they
+		   take other locks of their own.  Free memory in the other
+		   pool is cheaper than dropping caches, so borrow first. */
+		if (page_idx != BITMAP_ERROR
+				|| (!borrow_pages (pool, page_cnt, aligned)
+					&& shrink_caches (pool, page_cnt) == 0))
+			return page_idx;
+	}
+}
+
+/* Moves free pages from the other pool into POOL, which could not
+   find PAGE_CNT free pages (HPGSIZE-aligned if ALIGNED).  Takes a
+   BORROW_CHUNK-page run if it can, so that a pool under sustained
+   pressure does not come back for every page, and settles for
+   smaller runs down to PAGE_CNT.  The lender keeps its reserve.
+   Returns true if any pages moved. */
+static bool
+borrow_pages (struct pool *pool, size_t page_cnt, bool aligned) {
+	struct pool *lender = pool == &user_pool ? &kernel_pool : &user_pool;
+	size_t cnt = aligned || page_cnt > BORROW_CHUNK ? page_cnt : BORROW_CHUNK;
+	size_t idx = BITMAP_ERROR;
+	size_t free_cnt;
+
+	if (pool == &user_pool) {
+		if (user_pool.owned_cnt + page_cnt > user_page_limit)
+			return false;
+		if (user_pool.owned_cnt + cnt > user_page_limit)
+			cnt = user_page_limit - user_pool.owned_cnt;
+	}
+
+	lock_acquire (&lender->lock);
+	free_cnt = pool_free_cnt (lender);
+	for (;;) {
+		if (free_cnt >= lender->reserve + cnt) {
+			idx = aligned ? scan_aligned (lender, cnt)
+				: bitmap_scan_and_flip (lender->used_map, lender->first, cnt,
+						false);
+			if (idx != BITMAP_ERROR)
+				break;
+		}
+		if (cnt == page_cnt)
+			break;
+		cnt = cnt / 2 > page_cnt ? cnt / 2 : page_cnt;
+	}
+	if (idx != BITMAP_ERROR)
+		pool_adjust (lender, -cnt, -cnt);
+	lock_release (&lender->lock);
+	if (idx == BITMAP_ERROR)
+		return false;
+
+	/* The pages are marked used in both bitmaps until they are
+	   released into POOL's, so nobody can see them change hands. */
+	lock_acquire (&pool->lock);
+	bitmap_set_multiple (user_owned, idx, cnt, pool == &user_pool);
+	bitmap_set_multiple (pool->used_map, idx, cnt, false);
+	if (idx < pool->first)
+		pool->first = idx;
+	pool_adjust (pool, cnt, cnt);
+	pool->borrowed += cnt;
+	lock_release (&pool->lock);
+	return true;
+}
+
+/* Returns the number of free pages in POOL, not counting those
+   on its zeroed stack. */
+static size_t
+pool_free_cnt (const struct pool *pool) {
+	return pool->free_cnt;
+}
+
+/* Adds OWNED to the number of pages POOL owns and FREE to the
+   number of those that are free; either may wrap around to
+   subtract.  Interrupts are turned off, as for the zeroed stack,
+   so that palloc_sample() never sees one change without the
+   other.  Callers other than palloc_free_multiple() and
+   palloc_init() hold POOL's lock. */
+static void
+pool_adjust (struct pool *pool, size_t owned, size_t free) {
+	enum intr_level old_level = intr_disable ();
+	pool->owned_cnt += owned;
+	pool->free_cnt += free;
+	intr_set_level (old_level);
+}
+
+/* Asks the shrinkers that hold pages from POOL to release
+   PAGE_CNT pages in total, in priority order.  Returns the
+   number of pages actually released. */
+static size_t
+shrink_caches (struct pool *pool, size_t page_cnt) {
+	bool user = pool == &user_pool;
+	size_t freed = 0;
+	struct list_elem *e;
+
+	for (e = list_begin (&shrinkers);
+			e != list_end (&shrinkers) && freed < page_cnt; e = list_next (e)) {
+		struct shrinker *s = list_entry (e, struct shrinker, elem);
+		size_t cnt;
+
+		if (s->user != user || s->count () == 0)
+			continue;
+		cnt = s->scan (page_cnt - freed);
+		s->calls++;
+		s->reclaimed += cnt;
+		freed += cnt;
+	}
+	return freed;
+}
+
 /* Initializes pool P as starting at START and ending at END */
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
@@ -340,6 +767,11 @@ init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
 	lock_init(&p->lock);
 	p->used_map = bitmap_create_in_buf (pgcnt, *bm_base, bm_pages);
 	p->base = (void *) start;
+	p->first = 0;
+	p->owned_cnt = 0;
+	p->free_cnt = 0;
+	p->zeroed = NULL;
+	p->zeroed_cnt = 0;
 
 	// Mark all to unusable.
 	bitmap_set_all(p->used_map, true);
@@ -347,6 +779,25 @@ init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
 	*bm_base += bm_pages;
 }
 
+/* Finds PAGE_CNT free pages in POOL starting at a virtual (and
+   so physical) address aligned to PAGE_CNT pages, marks them used
+   and returns the index of the first one, or BITMAP_ERROR if
+   there is no such run.  POOL's lock must be held. */
+static size_t
+scan_aligned (struct pool *pool, size_t page_cnt) {
+	size_t pool_pages = bitmap_size (pool->used_map);
+	size_t align = page_cnt * PGSIZE;
+	size_t idx = ((ROUND_UP ((uint64_t) pool->base + pool->first * PGSIZE,
+					align) - (uint64_t) pool->base) / PGSIZE);
+
+	for (; idx + page_cnt <= pool_pages; idx += page_cnt)
+		if (bitmap_none (pool->used_map, idx, page_cnt)) {
+			bitmap_set_multiple (pool->used_map, idx, page_cnt, true);
+			return idx;
+		}
+	return BITMAP_ERROR;
+}
+
 /* Returns true if PAGE was allocated from POOL,
    false otherwise. */
 static bool
@@ -354,5 +805,64 @@ page_from_pool (const struct pool *pool, void *page) {
 	size_t page_no = pg_no (page);
 	size_t start_page = pg_no (pool->base);
 	size_t end_page = start_page + bitmap_size (pool->used_map);
-	return page_no >= start_page && page_no < end_page;
+
+	if (page_no < start_page || page_no >= end_page)
+		return false;
+	return bitmap_test (user_owned, page_no - start_page)
+		== (pool == &user_pool);
+}
+
+/* Pops a pre-zeroed page off POOL's stack, or returns a null
+   pointer if the stack is empty.  The link word kept in the page
+   is cleared so the whole page reads as zero. */
+static void *
+zeroed_pop (struct pool *pool) {
+	enum intr_level old_level = intr_disable ();
+	void **page = pool->zeroed;
+	if (page != NULL) {
+		pool->zeroed = *page;
+		pool->zeroed_cnt--;
+		*page = NULL;
+	}
+	intr_set_level (old_level);
+	return page;
+}
+
+/* Pushes zeroed PAGE, already marked used in POOL's bitmap,
+   onto POOL's stack. */
+static void
+zeroed_push (struct pool *pool, void *page) {
+	enum intr_level old_level = intr_disable ();
+	*(void **) page = pool->zeroed;
+	pool->zeroed = page;
+	pool->zeroed_cnt++;
+	intr_set_level (old_level);
+}
+
+/* Returns every page on POOL's zeroed stack to its bitmap so a
+   failing scan can see them.  POOL's lock must be held.  Returns
+   true if any page was released. */
+static bool
+zeroed_drain (struct pool *pool) {
+	bool released = false;
+	void *page;
+
+	ASSERT (lock_held_by_current_thread (&pool->lock));
+	while ((page = zeroed_pop (pool)) != NULL) {
+		bitmap_reset (pool->used_map, pg_no (page) - pg_no (pool->base));
+		pool_adjust (pool, 0, 1);
+		released = true;
+	}
+	return released;
+}
+
+/* Fills PAGE_CNT pages at PAGES with zeros, eight bytes at a
+   time. */
+static void
+zero_pages (void *pages, size_t page_cnt) {
+	uint64_t cnt = page_cnt * PGSIZE / sizeof (uint64_t);
+	asm volatile ("rep stosq"
+			: "+D" (pages), "+c" (cnt)
+			: "a" (0)
+			: "memory");
 }
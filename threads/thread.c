@@ -430,7 +430,10 @@ thread_get_recent_cpu (void)
    to it to enable thread_start() to continue, and immediately
    blocks.  After that, the idle thread never appears in the
    ready list.  It is returned by next_thread_to_run() as a
-   special case when the ready list is empty. */
+   special case when the ready list is empty.
+
+   Before halting, it spends otherwise wasted cycles refilling the
+   page allocator's pre-zeroed page pools. */
 static void
 idle (void *idle_started_ UNUSED) {
 	struct semaphore *idle_started = idle_started_;
@@ -439,6 +442,11 @@ idle (void *idle_started_ UNUSED) {
 	sema_up (idle_started);
 
 	for (;;) {
+		/* Nothing else wants the CPU, so zero free pages ahead of
+		   demand until some thread becomes ready again. */
+		while (list_empty (&ready_list) && palloc_zero_idle ())
+			continue;
+
 		/* Let someone else run. */
 		intr_disable ();
 		thread_block ();
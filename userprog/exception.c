@@ -5,6 +5,10 @@
 #include "threads/interrupt.h"
 #include "threads/thread.h"
 #include "intrinsic.h"
+#ifdef VM
+#include "threads/vaddr.h"
+#include "userprog/syscall.h"
+#endif
 
 /* Number of page faults processed. */
 static long long page_fault_cnt;
@@ -151,6 +155,11 @@ page_fault (struct intr_frame *f) {
 	/* For project 3 and later. */
 	if (vm_try_handle_fault (f, fault_addr, user, write, not_present))
 		return;
+
+	/* A bad user address, whether touched by the process or by the
+	 * kernel on its behalf, kills the process. */
+	if (user || is_user_vaddr (fault_addr))
+		exit (-1);
 #endif
 
 	/* Count page faults. */
@@ -14,6 +14,7 @@
 #include "threads/flags.h"
 #include "threads/init.h"
 #include "threads/interrupt.h"
+#include "threads/malloc.h"
 #include "threads/palloc.h"
 #include "threads/thread.h"
 #include "threads/mmu.h"
@@ -122,9 +123,22 @@ duplicate_pte (uint64_t *pte, void *va, void *aux) {
 	if (parent_page == NULL) {
 		return false;
 	}
+	/* A 2 MB mapping is duplicated as a whole. */
+	if (is_huge_pte (pte)) {
+		newpage = palloc_get_huge (PAL_USER);
+		if (newpage == NULL)
+			return false;
+		memcpy (newpage, parent_page, HPGSIZE);
+		if (!pml4_set_huge_page (current->pml4, va, newpage,
+					is_writable (pte))) {
+			palloc_free_huge (newpage);
+			return false;
+		}
+		return true;
+	}
 	/* 3. TODO: Allocate new PAL_USER page for the child and set result to
 	 *    TODO: NEWPAGE. */
-	newpage = palloc_get_page(PAL_USER | PAL_ZERO);
+	newpage = palloc_get_page(PAL_USER);
 	if (newpage == NULL) {
 		return false;
 	}
@@ -305,10 +319,11 @@ process_cleanup (void) {
 		 * process page directory.  We must activate the base page
 		 * directory before destroying the process's page
 		 * directory, or our active page directory will be one
-		 * that's been freed (and cleared). */
+		 * that's been freed (and cleared).  The reaper thread
+		 * does the freeing, so exit and exec do not wait for it. */
 		curr->pml4 = NULL;
 		pml4_activate (NULL);
-		pml4_destroy (pml4);
+		pml4_destroy_async (pml4);
 	}
 }
 
@@ -578,6 +593,7 @@ validate_segment (const struct Phdr *phdr, struct file *file) {
 
 /* load() helpers. */
 static bool install_page (void *upage, void *kpage, bool writable);
+static bool install_huge_page (void *upage, bool writable);
 
 /* Loads a segment starting at offset OFS in FILE at address
  * UPAGE.  In total, READ_BYTES + ZERO_BYTES bytes of virtual
@@ -608,6 +624,15 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 		size_t page_read_bytes = read_bytes < PGSIZE ? read_bytes : PGSIZE;
 		size_t page_zero_bytes = PGSIZE - page_read_bytes;
 
+		/* Map aligned 2 MB stretches of a large zero-filled region,
+		 * such as a big BSS, with a single huge page each. */
+		if (huge_pages && read_bytes == 0 && zero_bytes >= HPGSIZE
+				&& hpg_ofs (upage) == 0 && install_huge_page (upage, writable)) {
+			zero_bytes -= HPGSIZE;
+			upage += HPGSIZE;
+			continue;
+		}
+
 		/* Get a page of memory. */
 		uint8_t *kpage = palloc_get_page (PAL_USER);
 		if (kpage == NULL)
@@ -674,16 +699,43 @@ install_page (void *upage, void *kpage, bool writable) {
 	return (pml4_get_page (t->pml4, upage) == NULL
 			&& pml4_set_page (t->pml4, upage, kpage, writable));
 }
+
+/* Maps a zeroed huge page at the HPGSIZE-aligned user virtual
+ * address UPAGE, writable if WRITABLE is true.  Returns false,
+ * leaving nothing mapped, if no huge frame is free or part of
+ * the region is already mapped, so the caller can fall back to
+ * 4 kB pages. */
+static bool
+install_huge_page (void *upage, bool writable) {
+	struct thread *t = thread_current ();
+	void *kpage = palloc_get_huge (PAL_USER | PAL_ZERO);
+
+	if (kpage == NULL)
+		return false;
+	if (!pml4_set_huge_page (t->pml4, upage, kpage, writable)) {
+		palloc_free_huge (kpage);
+		return false;
+	}
+	return true;
+}
 #else
 /* From here, codes will be used after project 3.
  * If you want to implement the function for only project 2, implement it on the
  * upper block. */
 
+/* Reads the contents of PAGE, the struct file_page AUX, into its
+ * frame, then releases AUX. */
 static bool
 lazy_load_segment (struct page *page, void *aux) {
-	/* TODO: Load the segment from the file */
-	/* TODO: This called when the first page fault occurs on address VA. */
-	/* TODO: VA is available when calling this function. */
+	struct file_page *info = aux;
+	uint8_t *kva = page->frame->kva;
+	bool success;
+
+	success = file_read_at (info->file, kva, info->read_bytes, info->ofs)
+		== (off_t) info->read_bytes;
+	memset (kva + info->read_bytes, 0, PGSIZE - info->read_bytes);
+	file_page_free (info);
+	return success;
 }
 
 /* Loads a segment starting at offset OFS in FILE at address
@@ -714,16 +766,47 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 		size_t page_read_bytes = read_bytes < PGSIZE ? read_bytes : PGSIZE;
 		size_t page_zero_bytes = PGSIZE - page_read_bytes;
 
-		/* TODO: Set up aux to pass information to the lazy_load_segment. */
-		void *aux = NULL;
-		if (!vm_alloc_page_with_initializer (VM_ANON, upage,
-					writable, lazy_load_segment, aux))
+		/* A page with nothing to read, such as BSS, is a plain
+		 * anonymous page, which reads as the shared zero page
+		 * until it is written.  Unlike the project 2 loader, this
+		 * one never maps a huge page: eviction, swap and fork
+		 * sharing all work a 4 kB frame at a time. */
+		if (page_read_bytes == 0) {
+			if (!vm_alloc_page (VM_ANON, upage, writable))
+				return false;
+			zero_bytes -= PGSIZE;
+			upage += PGSIZE;
+			continue;
+		}
+
+		/* Each page keeps its own handle, since FILE is closed
+		 * when load() returns. */
+		struct file_page *aux = malloc (sizeof *aux);
+		if (aux == NULL)
+			return false;
+		aux->file = file_reopen (file);
+		aux->ofs = ofs;
+		aux->read_bytes = page_read_bytes;
+		aux->map_pages = 0;
+		aux->shared = !writable;
+
+		/* Read-only text is file-backed, so processes running the
+		 * same program share it through the text cache. */
+		if (aux->file == NULL
+				|| !(writable
+					? vm_alloc_page_with_initializer (VM_ANON, upage,
+						writable, lazy_load_segment, aux)
+					: vm_alloc_page_with_initializer (VM_FILE, upage,
+						writable, NULL, aux))) {
+			file_page_free (aux);
 			return false;
+		}
 
 		/* Advance. */
 		read_bytes -= page_read_bytes;
 		zero_bytes -= page_zero_bytes;
 		upage += PGSIZE;
+		ofs += page_read_bytes;
 	}
 	return true;
 }
@@ -734,11 +817,11 @@ setup_stack (struct intr_frame *if_) {
 	bool success = false;
 	void *stack_bottom = (void *) (((uint8_t *) USER_STACK) - PGSIZE);
 
-	/* TODO: Map the stack on stack_bottom and claim the page immediately.
-	 * TODO: If success, set the rsp accordingly.
-	 * TODO: You should mark the page is stack. */
-	/* TODO: Your code goes here */
-
+	if (vm_alloc_page (VM_ANON | VM_MARKER_0, stack_bottom, true)
+			&& vm_claim_page (stack_bottom)) {
+		success = true;
+		if_->rsp = USER_STACK;
+	}
 	return success;
 }
 #endif /* VM */
@@ -15,6 +15,9 @@
 #include "threads/flags.h"
 #include "intrinsic.h"
 #include "userprog/process.h"
+#ifdef VM
+#include "vm/vm.h"
+#endif
 
 void syscall_entry(void);
 void syscall_handler(struct intr_frame *);
@@ -49,6 +52,12 @@ void close(int fd);
 int fork(const char *thread_name, struct intr_frame *f);
 int exec(const char *cmd_line);
 int wait(int pid);
+#ifdef VM
+void *mmap(void *addr, size_t length, int writable, int fd, off_t offset);
+void munmap(void *addr);
+int madvise(void *addr, size_t length, int advice);
+int msync(void *addr, size_t length);
+#endif
 
 void syscall_init(void)
 {
@@ -69,6 +78,10 @@ void syscall_handler(struct intr_frame *f UNUSED)
 {
 	int syscall_num = f->R.rax;
 
+#ifdef VM
+	/* A page fault in the kernel grows the stack from here. */
+	thread_current()->user_rsp = (void *)f->rsp;
+#endif
 	check_address(f->rsp);
 
 	switch (syscall_num)
@@ -115,6 +128,20 @@ void syscall_handler(struct intr_frame *f UNUSED)
 	case SYS_CLOSE:
 		close(f->R.rdi);
 		break;
+#ifdef VM
+	case SYS_MMAP:
+		f->R.rax = (uint64_t)mmap((void *)f->R.rdi, f->R.rsi, f->R.rdx, f->R.r10, f->R.r8);
+		break;
+	case SYS_MUNMAP:
+		munmap((void *)f->R.rdi);
+		break;
+	case SYS_MADVISE:
+		f->R.rax = madvise((void *)f->R.rdi, f->R.rsi, f->R.rdx);
+		break;
+	case SYS_MSYNC:
+		f->R.rax = msync((void *)f->R.rdi, f->R.rsi);
+		break;
+#endif
 	}
 	// thread_exit ();
 }
@@ -127,9 +154,13 @@ void check_address(void *addr)
 	// 포인터가 USER 영역인지 체크 커널이면 EXIT
 	if (!is_user_vaddr(addr))
 		exit(-1);
+#ifndef VM
 	// 현재 스레드의 페이지 맵 레벨 4(pml4)를 확인하여 주어진 주소에 대한 페이지가 있는지 확인하는 pml4_get_page 함수를 호출 만약 해당 주소에 대한 페이지가 없다면 EXIT
 	if (pml4_get_page(thread_current()->pml4, addr) == NULL)
 		exit(-1);
+#endif
+	/* With VM, pages not loaded yet fault in when touched, and
+	 * bad addresses fault into exit(-1). */
 }
 
 void halt(void)
@@ -141,6 +172,10 @@ void exit(int status)
 {
 	struct thread *cur = thread_current (); 
 	cur->exit_status = status;
+#ifdef VM
+	if (fault_stats)
+		printf("%s: %lld major faults\n", cur->name, cur->major_faults);
+#endif
 	printf("%s: exit(%d)\n" , cur -> name , status);
 	thread_exit();
 }
@@ -343,3 +378,31 @@ void close(int fd)
 	file_close(file);
 	process_close_file(fd);
 }
+
+#ifdef VM
+void *
+mmap(void *addr, size_t length, int writable, int fd, off_t offset)
+{
+	if (fd < 2)
+		return NULL;
+	struct file *file = process_get_file(fd);
+	if (file == NULL)
+		return NULL;
+	return do_mmap(addr, length, writable, file, offset);
+}
+
+void munmap(void *addr)
+{
+	do_munmap(addr);
+}
+
+int madvise(void *addr, size_t length, int advice)
+{
+	return vm_madvise(addr, length, advice) ? 0 : -1;
+}
+
+int msync(void *addr, size_t length)
+{
+	return file_msync(addr, length) ? 0 : -1;
+}
+#endif
@@ -1,8 +1,23 @@
 /* anon.c: Implementation of page for non-disk image (a.k.a. anonymous page). */
 
+#include <bitmap.h>
+#include <list.h>
+#include <round.h>
+#include <lz.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
 #include "vm/vm.h"
+#include "vm/frame.h"
 #include "devices/disk.h"
 
+/* Disk sectors per swap slot, one page. */
+#define SECTORS_PER_SLOT (PGSIZE / DISK_SECTOR_SIZE)
+
 /* DO NOT MODIFY BELOW LINE */
 static struct disk *swap_disk;
 static bool anon_swap_in (struct page *page, void *kva);
@@ -17,36 +32,587 @@ static const struct page_operations anon_ops = {
 	.type = VM_ANON,
 };
 
+/* Swap slots, one bit per page-sized run of sectors on SWAP_DISK,
+ * set while a page is stored there.  A frame shared by several
+ * pages is written once, so a slot may be bound to several pages;
+ * SWAP_REFS counts them. */
+static struct bitmap *swap_slots;
+static uint16_t *swap_refs;
+static struct lock swap_lock;           /* Protects both. */
+static size_t swap_used;                /* Slots in use. */
+
+/* Statistics. */
+static size_t swap_peak;                /* Most slots in use at once. */
+static long long swap_out_cnt;          /* Pages written out. */
+static long long swap_cluster_cnt;      /* Runs they were written in. */
+static long long swap_in_cnt;           /* Pages read back. */
+static long long swap_clean_cnt;        /* Evicted without a write. */
+static long long swap_reclaim_cnt;      /* Taken back from resident pages. */
+
+/* Swap readahead.  Reading a page back from disk also reads the
+ * swapped-out pages that follow it in the owner's address space,
+ * up to RA_WINDOW in all, into free frames that are not mapped:
+ * the swap cache.  A fault on one of them takes its frame without
+ * any I/O.  Cached frames keep their slots, so eviction drops them
+ * for free.  Every RA_SAMPLE cached pages used or dropped, the
+ * window doubles if at least three in four were used, and halves
+ * if fewer than one in four were. */
+#define RA_MAX 16
+#define RA_SAMPLE 16
+static size_t ra_window = 4;
+static size_t ra_sample_hits;           /* Used in this sample... */
+static size_t ra_sample_cnt;            /* ...out of this many. */
+
+/* Readahead statistics. */
+static long long ra_read_cnt;           /* Pages read ahead. */
+static long long ra_hit_cnt;            /* ...then faulted in. */
+static long long ra_drop_cnt;           /* ...or dropped unused. */
+static size_t ra_window_max;            /* Largest window reached. */
+
+/* Compressed tier in front of the swap disk.  An evicted page that
+ * compresses to half a page or less is kept in memory, compressed,
+ * instead of being written out.  When the tier is full, the pages
+ * that have been in it longest are cold and spill to disk.  The
+ * compressed copies are malloc()'d from the kernel pool, so they
+ * also spill when that pool runs short, through a shrinker. */
+struct zpage {
+	struct list_elem elem;      /* Element in ZPAGES. */
+	struct page *page;          /* Page stored. */
+	size_t len;                 /* Bytes in DATA. */
+	uint8_t data[];             /* Compressed contents. */
+};
+
+/* Size of the tier, as a percentage of the user pool; 0 turns it
+ * off.  Set with the -zswap kernel option. */
+unsigned zswap_percent = 20;
+
+static struct list zpages;              /* Oldest first. */
+static size_t zswap_bytes;              /* Memory in use... */
+static size_t zswap_budget;             /* ...and allowed. */
+static uint16_t lz_table[LZ_TABLE_SIZE];
+static uint8_t zbuf[PGSIZE / 2 - sizeof (struct zpage)];
+static uint8_t bounce[PGSIZE];          /* For spilling to disk. */
+
+/* Compressed tier statistics. */
+static long long zswap_store_cnt;       /* Pages stored. */
+static long long zswap_raw_bytes;       /* Their size... */
+static long long zswap_packed_bytes;    /* ...and compressed size. */
+static long long zswap_hit_cnt;         /* Pages read back from it. */
+static long long zswap_spill_cnt;       /* Pages spilled to disk. */
+static long long zswap_reject_cnt;      /* Pages that did not compress. */
+
+static size_t zswap_shrink_count (void);
+static size_t zswap_shrink_scan (size_t page_cnt);
+
+/* Spills compressed pages to disk when the kernel pool runs dry.
+ * That costs disk writes, so cheaper caches go first. */
+static struct shrinker zswap_shrinker = {
+	.name = "zswap",
+	.priority = 1,
+	.user = false,
+	.count = zswap_shrink_count,
+	.scan = zswap_shrink_scan,
+};
+
 /* Initialize the data for anonymous pages */
 void
 vm_anon_init (void) {
-	/* TODO: Set up the swap_disk. */
-	swap_disk = NULL;
+	swap_disk = disk_get (1, 1);
+	lock_init (&swap_lock);
+	swap_slots = bitmap_create (swap_disk != NULL
+			? disk_size (swap_disk) / SECTORS_PER_SLOT : 0);
+	if (swap_slots == NULL)
+		PANIC ("vm_anon_init: cannot allocate swap slot bitmap");
+	swap_refs = calloc (bitmap_size (swap_slots), sizeof *swap_refs);
+	if (swap_refs == NULL && bitmap_size (swap_slots) > 0)
+		PANIC ("vm_anon_init: cannot allocate swap slot counts");
+
+	list_init (&zpages);
+	zswap_budget = palloc_user_pages () * PGSIZE / 100 * zswap_percent;
+	palloc_register_shrinker (&zswap_shrinker);
 }
 
 /* Initialize the file mapping */
 bool
 anon_initializer (struct page *page, enum vm_type type, void *kva) {
+	/* Pages without a loader, such as the stack, start zeroed.  A
+	 * null KVA means the page starts out sharing a frame instead. */
+	bool zero = page->uninit.init == NULL && kva != NULL;
+
 	/* Set up the handler */
 	page->operations = &anon_ops;
 
 	struct anon_page *anon_page = &page->anon;
+	anon_page->slot = BITMAP_ERROR;
+	anon_page->zpage = NULL;
+	anon_page->cache = NULL;
+	if (zero)
+		memset (kva, 0, PGSIZE);
+	return true;
+}
+
+static bool swap_reclaim_resident (void);
+
+/* Allocates a run of CNT contiguous free swap slots and returns
+ * the first, or BITMAP_ERROR if there is no such run.  A single
+ * slot that cannot be found is taken back from the pages in memory
+ * that kept theirs, see swap_reclaim_resident(). */
+static size_t
+swap_slot_alloc (size_t cnt) {
+	size_t slot;
+
+	for (;;) {
+		lock_acquire (&swap_lock);
+		slot = bitmap_scan_and_flip (swap_slots, 0, cnt, false);
+		if (slot != BITMAP_ERROR) {
+			swap_used += cnt;
+			if (swap_used > swap_peak)
+				swap_peak = swap_used;
+		}
+		lock_release (&swap_lock);
+		if (slot != BITMAP_ERROR || cnt > 1 || !swap_reclaim_resident ())
+			return slot;
+	}
+}
+
+/* Returns true if more than half the swap slots are in use.  Pages
+ * read back from swap then give up their slots at once, instead of
+ * keeping them in case they are evicted again unchanged. */
+static bool
+swap_full (void) {
+	return swap_used * 2 > bitmap_size (swap_slots);
+}
+
+/* Binds swap slot SLOT, allocated with swap_slot_alloc(), to
+ * anonymous PAGE. */
+static void
+swap_slot_bind (struct page *page, size_t slot) {
+	lock_acquire (&swap_lock);
+	ASSERT (bitmap_test (swap_slots, slot));
+	swap_refs[slot]++;
+	page->anon.slot = slot;
+	lock_release (&swap_lock);
+}
+
+/* Drops one page's binding to swap slot SLOT, and frees the slot
+ * with the last one. */
+static void
+swap_slot_put (size_t slot) {
+	lock_acquire (&swap_lock);
+	ASSERT (bitmap_test (swap_slots, slot) && swap_refs[slot] > 0);
+	if (--swap_refs[slot] == 0) {
+		bitmap_reset (swap_slots, slot);
+		swap_used--;
+	}
+	lock_release (&swap_lock);
+}
+
+/* Returns true if every page mapping FRAME is bound to the same
+ * swap slot and clean, so the slot still holds FRAME's contents. */
+static bool
+frame_in_slot (struct frame *frame) {
+	size_t slot = frame->page->anon.slot;
+	struct page *p;
+
+	if (slot == BITMAP_ERROR)
+		return false;
+	for (p = frame->page; p != NULL; p = p->rmap_next)
+		if (p->anon.slot != slot || pml4_is_dirty (p->owner->pml4, p->va))
+			return false;
+	return true;
+}
+
+/* Releases the swap slots of the pages mapping FRAME. */
+static void
+frame_release_slots (struct frame *frame) {
+	struct page *p;
+
+	for (p = frame->page; p != NULL; p = p->rmap_next)
+		if (p->anon.slot != BITMAP_ERROR) {
+			swap_slot_put (p->anon.slot);
+			p->anon.slot = BITMAP_ERROR;
+		}
+}
+
+/* Releases the slots kept by resident anonymous pages since their
+ * last swap-in, so that swap_slot_alloc() can hand them out again.
+ * They only save a write if their pages are evicted unchanged.
+ * Frames being evicted are pinned and keep theirs, as do swap
+ * cache frames, whose pages are not in memory.  Returns true if any
+ * slot was freed.  The caller must hold vm_lock. */
+static bool
+swap_reclaim_resident (void) {
+	size_t before = swap_used;
+	size_t i;
+
+	ASSERT (lock_held_by_current_thread (&vm_lock));
+
+	for (i = 0; i < frame_cnt (); i++) {
+		struct frame *frame = frame_at (i);
+
+		if ((frame->flags & (FRAME_USED | FRAME_PINNED | FRAME_TEXT
+						| FRAME_SWAPCACHE)) != FRAME_USED
+				|| frame->page == NULL
+				|| VM_TYPE (frame->page->operations->type) != VM_ANON)
+			continue;
+		frame_release_slots (frame);
+	}
+	swap_reclaim_cnt += before - swap_used;
+	return swap_used < before;
+}
+
+/* Writes page-sized slot SLOT of the swap disk from KVA. */
+static void
+swap_write (size_t slot, const void *kva) {
+	disk_sector_t sector = slot * SECTORS_PER_SLOT;
+	size_t j;
+
+	for (j = 0; j < SECTORS_PER_SLOT; j++)
+		disk_write (swap_disk, sector + j,
+				(const uint8_t *) kva + j * DISK_SECTOR_SIZE);
+}
+
+/* Reads page-sized slot SLOT of the swap disk into KVA. */
+static void
+swap_read (size_t slot, void *kva) {
+	disk_sector_t sector = slot * SECTORS_PER_SLOT;
+	size_t j;
+
+	for (j = 0; j < SECTORS_PER_SLOT; j++)
+		disk_read (swap_disk, sector + j, (uint8_t *) kva + j * DISK_SECTOR_SIZE);
+}
+
+/* Records whether a page read ahead was USED, and resizes the
+ * window at the end of each sample. */
+static void
+ra_account (bool used) {
+	if (used) {
+		ra_hit_cnt++;
+		ra_sample_hits++;
+	} else
+		ra_drop_cnt++;
+	if (++ra_sample_cnt < RA_SAMPLE)
+		return;
+
+	if (ra_sample_hits * 4 >= ra_sample_cnt * 3 && ra_window < RA_MAX)
+		ra_window *= 2;
+	else if (ra_sample_hits * 4 < ra_sample_cnt && ra_window > 2)
+		ra_window /= 2;
+	if (ra_window > ra_window_max)
+		ra_window_max = ra_window;
+	ra_sample_hits = ra_sample_cnt = 0;
+}
+
+/* Reads into the swap cache the pages after PAGE in its owner's
+ * address space that are swapped out to disk, stopping at the
+ * first that is not, at the end of the window, or when no frame is
+ * free: eviction is not worth it for pages that may go unused. */
+static void
+swap_readahead (struct page *page) {
+	struct supplemental_page_table *spt = &page->owner->spt;
+	size_t i;
+
+	for (i = 1; i < ra_window; i++) {
+		struct page *next = spt_find_page (spt,
+				(uint8_t *) page->va + i * PGSIZE);
+		struct frame *frame;
+
+		if (next == NULL || VM_TYPE (next->operations->type) != VM_ANON
+				|| next->frame != NULL || next->anon.cache != NULL
+				|| next->anon.slot == BITMAP_ERROR)
+			break;
+		frame = frame_alloc ();
+		if (frame == NULL)
+			break;
+		swap_read (next->anon.slot, frame->kva);
+		frame->page = next;
+		frame->flags = FRAME_USED | FRAME_SWAPCACHE;
+		next->anon.cache = frame;
+		ra_read_cnt++;
+	}
+}
+
+/* If PAGE has a copy in the swap cache, takes its frame out of the
+ * cache and returns it pinned, with no page, as vm_get_frame()
+ * would; the caller maps it without swapping anything in.
+ * Otherwise, returns a null pointer. */
+struct frame *
+anon_take_cache (struct page *page) {
+	struct anon_page *anon_page = &page->anon;
+	struct frame *frame;
+
+	if (VM_TYPE (page->operations->type) != VM_ANON
+			|| anon_page->cache == NULL)
+		return NULL;
+	frame = anon_page->cache;
+	anon_page->cache = NULL;
+	frame->page = NULL;
+	frame->flags = FRAME_USED | FRAME_PINNED;
+	if (swap_full ()) {
+		swap_slot_put (anon_page->slot);
+		anon_page->slot = BITMAP_ERROR;
+	}
+	ra_account (true);
+	return frame;
+}
+
+/* Drops FRAME, pinned, from the swap cache.  Its page stays in
+ * its swap slot, and FRAME is left with no page. */
+void
+anon_drop_cache (struct frame *frame) {
+	ASSERT (frame->flags & FRAME_SWAPCACHE);
+	frame->page->anon.cache = NULL;
+	frame->page = NULL;
+	frame->flags &= ~FRAME_SWAPCACHE;
+	ra_account (false);
 }
 
-/* Swap in the page by read contents from the swap disk. */
+/* Drops Z from the compressed tier. */
+static void
+zswap_free (struct zpage *z) {
+	list_remove (&z->elem);
+	zswap_bytes -= sizeof *z + z->len;
+	z->page->anon.zpage = NULL;
+	free (z);
+}
+
+/* Moves the page that has been in the compressed tier longest to
+ * the swap disk.  Returns false if the tier or the disk is full. */
+static bool
+zswap_spill (void) {
+	struct zpage *z;
+	size_t slot;
+
+	if (list_empty (&zpages))
+		return false;
+	slot = swap_slot_alloc (1);
+	if (slot == BITMAP_ERROR)
+		return false;
+
+	z = list_entry (list_front (&zpages), struct zpage, elem);
+	if (!lz_decompress (z->data, z->len, bounce, PGSIZE))
+		PANIC ("zswap_spill: corrupt compressed page");
+	swap_write (slot, bounce);
+	swap_slot_bind (z->page, slot);
+	zswap_free (z);
+	swap_out_cnt++;
+	zswap_spill_cnt++;
+	return true;
+}
+
+/* Shrinker callback: returns the pages' worth of memory the
+ * compressed tier holds. */
+static size_t
+zswap_shrink_count (void) {
+	return zswap_bytes / PGSIZE;
+}
+
+/* Shrinker callback: spills the coldest compressed pages to disk
+ * until about PAGE_CNT pages' worth of memory is freed, and
+ * returns how many pages' worth was.  The tier is protected by
+ * VM_LOCK; an allocation made while holding it, such as the one in
+ * zswap_store(), leaves the tier consistent, and any other holder
+ * is not waited for. */
+static size_t
+zswap_shrink_scan (size_t page_cnt) {
+	bool locked = lock_held_by_current_thread (&vm_lock);
+	size_t before = zswap_bytes;
+
+	if (!locked && !lock_try_acquire (&vm_lock))
+		return 0;
+	while (before - zswap_bytes < page_cnt * PGSIZE && zswap_spill ())
+		continue;
+	if (!locked)
+		lock_release (&vm_lock);
+	return DIV_ROUND_UP (before - zswap_bytes, PGSIZE);
+}
+
+/* Stores unmapped PAGE in the compressed tier, spilling cold pages
+ * to make room.  Returns false if PAGE does not compress to half a
+ * page or there is no room for it. */
+static bool
+zswap_store (struct page *page) {
+	struct zpage *z;
+	size_t len;
+
+	if (zswap_budget == 0)
+		return false;
+	len = lz_compress (page->frame->kva, PGSIZE, zbuf, sizeof zbuf, lz_table);
+	if (len == 0) {
+		zswap_reject_cnt++;
+		return false;
+	}
+	while (zswap_bytes + sizeof *z + len > zswap_budget)
+		if (!zswap_spill ())
+			return false;
+	z = malloc (sizeof *z + len);
+	if (z == NULL)
+		return false;
+
+	z->page = page;
+	z->len = len;
+	memcpy (z->data, zbuf, len);
+	list_push_back (&zpages, &z->elem);
+	zswap_bytes += sizeof *z + len;
+	page->anon.zpage = z;
+	zswap_store_cnt++;
+	zswap_raw_bytes += PGSIZE;
+	zswap_packed_bytes += len;
+	return true;
+}
+
+/* Swaps out the CNT unmapped pages in PAGES, setting OUT[i] to
+ * whether PAGES[i] went.  Each stands for its frame and every page
+ * mapping it, which all get the same slot.  Pages that kept their
+ * slot when swapped in and are clean are dropped as they are.  Of
+ * the rest, private pages that compress well stay in memory,
+ * compressed.  The rest are written to disk in order, as one run
+ * of contiguous slots where possible so the disk sees a single
+ * sequential write.  Like borrowing pages between pools, a run that
+ * cannot be found is halved until one fits.  Returns the number of
+ * pages swapped out, which is less than CNT only if swap is full. */
+size_t
+anon_swap_out_cluster (struct page *pages[], size_t cnt, bool out[]) {
+	struct page *disk_pages[cnt];
+	size_t disk_cnt = 0;
+	size_t done = 0;
+	size_t run, k;
+
+	for (k = 0; k < cnt; k++) {
+		struct page *page = pages[k];
+		struct frame *frame = page->frame;
+
+		/* A page still in its slot from the last swap-in needs no
+		 * write unless it has changed since. */
+		if (frame_in_slot (frame)) {
+			out[k] = true;
+			swap_clean_cnt++;
+			continue;
+		}
+		frame_release_slots (frame);
+
+		/* The compressed tier holds private pages only. */
+		out[k] = frame->ref_cnt == 1 && zswap_store (page);
+		if (!out[k])
+			disk_pages[disk_cnt++] = page;
+	}
+
+	run = disk_cnt;
+	while (done < disk_cnt) {
+		size_t slot, i;
+
+		if (run > disk_cnt - done)
+			run = disk_cnt - done;
+		slot = swap_slot_alloc (run);
+		if (slot == BITMAP_ERROR) {
+			if (run == 1)
+				break;
+			run /= 2;
+			continue;
+		}
+
+		for (i = 0; i < run; i++) {
+			struct frame *frame = disk_pages[done + i]->frame;
+			struct page *p;
+
+			swap_write (slot + i, frame->kva);
+			for (p = frame->page; p != NULL; p = p->rmap_next)
+				swap_slot_bind (p, slot + i);
+		}
+		done += run;
+		swap_out_cnt += run;
+		swap_cluster_cnt++;
+	}
+
+	/* Mark the pages that made it to disk. */
+	for (k = 0; done > 0; k++)
+		if (!out[k]) {
+			out[k] = true;
+			done--;
+			disk_cnt--;
+		}
+	return cnt - disk_cnt;
+}
+
+/* Swap in the page by read contents from the swap disk.  The page
+ * keeps its slot, unless swap is filling up, so that eviction can
+ * drop it without a write if it stays clean.  If swap fills up
+ * later, swap_slot_alloc() takes the slot back. */
 static bool
 anon_swap_in (struct page *page, void *kva) {
 	struct anon_page *anon_page = &page->anon;
+
+	if (anon_page->zpage != NULL) {
+		struct zpage *z = anon_page->zpage;
+		if (!lz_decompress (z->data, z->len, kva, PGSIZE))
+			PANIC ("anon_swap_in: corrupt compressed page");
+		zswap_free (z);
+		zswap_hit_cnt++;
+		return true;
+	}
+	if (anon_page->slot == BITMAP_ERROR)
+		return true;
+
+	swap_read (anon_page->slot, kva);
+	if (swap_full ()) {
+		swap_slot_put (anon_page->slot);
+		anon_page->slot = BITMAP_ERROR;
+	}
+	swap_in_cnt++;
+	swap_readahead (page);
+	return true;
 }
 
 /* Swap out the page by writing contents to the swap disk. */
 static bool
 anon_swap_out (struct page *page) {
-	struct anon_page *anon_page = &page->anon;
+	bool out;
+
+	anon_swap_out_cluster (&page, 1, &out);
+	return out;
 }
 
 /* Destroy the anonymous page. PAGE will be freed by the caller. */
 static void
 anon_destroy (struct page *page) {
 	struct anon_page *anon_page = &page->anon;
+
+	if (page->frame != NULL)
+		vm_free_frame (page);
+	if (anon_page->cache != NULL) {
+		struct frame *frame = anon_page->cache;
+		anon_drop_cache (frame);
+		frame_free (frame);
+	}
+	if (anon_page->zpage != NULL)
+		zswap_free (anon_page->zpage);
+	if (anon_page->slot != BITMAP_ERROR)
+		swap_slot_put (anon_page->slot);
+}
+
+/* Prints swap statistics. */
+void
+anon_print_stats (void) {
+	if (swap_out_cnt > 0)
+		printf ("Swap: %zu slots, %zu peak in use, %lld pages out "
+				"in %lld runs, %lld dropped clean, %lld pages in, "
+				"%lld slots reclaimed\n",
+				bitmap_size (swap_slots), swap_peak, swap_out_cnt,
+				swap_cluster_cnt, swap_clean_cnt, swap_in_cnt,
+				swap_reclaim_cnt);
+	if (ra_read_cnt > 0)
+		printf ("Swap readahead: %lld pages read ahead, %lld used, "
+				"%lld dropped; window %zu pages now, %zu at most\n",
+				ra_read_cnt, ra_hit_cnt, ra_drop_cnt, ra_window,
+				ra_window_max > ra_window ? ra_window_max : ra_window);
+	if (zswap_store_cnt > 0)
+		printf ("Zswap: %lld pages stored at %lld%% of their size, "
+				"%lld incompressible; %lld read back, %lld%% of swap-ins; "
+				"%lld spilled to disk; %lld sector writes saved\n",
+				zswap_store_cnt, zswap_packed_bytes * 100 / zswap_raw_bytes,
+				zswap_reject_cnt, zswap_hit_cnt,
+				zswap_hit_cnt * 100 / (zswap_hit_cnt + swap_in_cnt > 0
+					? zswap_hit_cnt + swap_in_cnt : 1),
+				zswap_spill_cnt,
+				(zswap_store_cnt - zswap_spill_cnt) * SECTORS_PER_SLOT);
 }
@@ -1,5 +1,16 @@
 /* file.c: Implementation of memory backed file object (mmaped object). */
 
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall-nr.h>
+#include "devices/timer.h"
+#include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/palloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "vm/frame.h"
 #include "vm/vm.h"
 
 static bool file_backed_swap_in (struct page *page, void *kva);
@@ -14,45 +25,324 @@ static const struct page_operations file_ops = {
 	.type = VM_FILE,
 };
 
+/* Writeback.  Dirty mmap'd pages reach their file on eviction,
+ * on munmap, on msync(), and from the "flusher" thread, which
+ * wakes every FLUSH_INTERVAL ticks and writes back every dirty
+ * page it finds in the frame table.  Each write covers a run of
+ * up to FLUSH_RUN_MAX pages that are adjacent both in memory and
+ * in the file, copied together into FLUSH_BUF. */
+#define FLUSH_RUN_MAX 16
+static uint8_t *flush_buf;
+
+/* Ticks between flusher passes; 0 disables the flusher.  Set with
+ * the -flush kernel option. */
+int64_t flush_interval = 5 * TIMER_FREQ;
+
+/* Writeback statistics. */
+static long long flush_cnt;             /* Flusher passes that wrote. */
+static long long flush_page_cnt;        /* Pages they wrote... */
+static long long flush_write_cnt;       /* ...in this many writes. */
+static size_t flush_page_max;           /* Most pages in one pass. */
+static long long msync_page_cnt;        /* Pages written by msync(). */
+
 /* The initializer of file vm */
 void
 vm_file_init (void) {
+	flush_buf = palloc_get_multiple (PAL_ASSERT, FLUSH_RUN_MAX);
 }
 
 /* Initialize the file backed page */
 bool
 file_backed_initializer (struct page *page, enum vm_type type, void *kva) {
+	/* The aux overlaps PAGE->file, so take it first. */
+	struct file_page *info = page->uninit.aux;
+
 	/* Set up the handler */
 	page->operations = &file_ops;
 
 	struct file_page *file_page = &page->file;
+	*file_page = *info;
+	free (info);
+
+	/* A null KVA means the caller filled the frame itself. */
+	return kva == NULL || file_backed_swap_in (page, kva);
 }
 
 /* Swap in the page by read contents from the file. */
 static bool
 file_backed_swap_in (struct page *page, void *kva) {
-	struct file_page *file_page UNUSED = &page->file;
+	struct file_page *file_page = &page->file;
+
+	if (file_read_at (file_page->file, kva, file_page->read_bytes,
+				file_page->ofs) != (off_t) file_page->read_bytes)
+		return false;
+	memset ((uint8_t *) kva + file_page->read_bytes, 0,
+			PGSIZE - file_page->read_bytes);
+	return true;
 }
 
-/* Swap out the page by writeback contents to the file. */
+/* Swap out the page by writeback contents to the file.  The page
+ * is already unmapped; a clean page is simply dropped, to be read
+ * back from the file on the next fault. */
 static bool
 file_backed_swap_out (struct page *page) {
-	struct file_page *file_page UNUSED = &page->file;
+	struct file_page *file_page = &page->file;
+
+	if (pml4_is_dirty (page->owner->pml4, page->va)
+			&& file_write_at (file_page->file, page->frame->kva,
+				file_page->read_bytes, file_page->ofs)
+			!= (off_t) file_page->read_bytes)
+		return false;
+	return true;
 }
 
 /* Destory the file backed page. PAGE will be freed by the caller. */
 static void
 file_backed_destroy (struct page *page) {
-	struct file_page *file_page UNUSED = &page->file;
+	struct file_page *file_page = &page->file;
+
+	if (page->frame != NULL) {
+		if (pml4_is_dirty (page->owner->pml4, page->va))
+			file_write_at (file_page->file, page->frame->kva,
+					file_page->read_bytes, file_page->ofs);
+		vm_free_frame (page);
+	}
+	file_close (file_page->file);
+}
+
+/* Returns true if PAGE is a private, loaded file page with its
+ * dirty bit set.  PAGE may be a null pointer. */
+static bool
+is_dirty_file_page (struct page *page) {
+	return page != NULL && page->frame != NULL
+		&& !(page->frame->flags & FRAME_PINNED)
+		&& VM_TYPE (page->operations->type) == VM_FILE
+		&& !page->file.shared
+		&& pml4_is_dirty (page->owner->pml4, page->va);
+}
+
+/* Returns true if NEXT, the page just above PREV, holds the data
+ * that follows PREV's full page in the same file. */
+static bool
+continues_file (struct page *prev, struct page *next) {
+	return prev->file.read_bytes == PGSIZE
+		&& next->file.ofs == prev->file.ofs + PGSIZE
+		&& file_get_inode (next->file.file)
+		== file_get_inode (prev->file.file);
 }
 
-/* Do the mmap */
+/* Writes back the run of dirty file pages through dirty file PAGE,
+ * up to FLUSH_RUN_MAX pages, with one write.  The dirty bits are
+ * cleared before the contents are copied, so a store made after
+ * that dirties the page again for the next flush.  Returns the
+ * number of pages written.  The caller holds VM_LOCK. */
+static size_t
+flush_run (struct page *page) {
+	struct supplemental_page_table *spt = &page->owner->spt;
+	struct page *run[FLUSH_RUN_MAX];
+	size_t cnt, i;
+	off_t bytes;
+
+	ASSERT (is_dirty_file_page (page));
+
+	for (i = 1; i < FLUSH_RUN_MAX; i++) {
+		struct page *prev = spt_find_page (spt, (uint8_t *) page->va - PGSIZE);
+		if (!is_dirty_file_page (prev) || !continues_file (prev, page))
+			break;
+		page = prev;
+	}
+	run[0] = page;
+	for (cnt = 1; cnt < FLUSH_RUN_MAX; cnt++) {
+		struct page *next = spt_find_page (spt,
+				(uint8_t *) run[cnt - 1]->va + PGSIZE);
+		if (!is_dirty_file_page (next) || !continues_file (run[cnt - 1], next))
+			break;
+		run[cnt] = next;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		pml4_set_dirty (run[i]->owner->pml4, run[i]->va, false);
+		memcpy (flush_buf + i * PGSIZE, run[i]->frame->kva, PGSIZE);
+	}
+	bytes = (cnt - 1) * PGSIZE + run[cnt - 1]->file.read_bytes;
+	if (file_write_at (page->file.file, flush_buf, bytes, page->file.ofs)
+			!= bytes) {
+		/* Leave them for eviction or munmap to try again. */
+		for (i = 0; i < cnt; i++)
+			pml4_set_dirty (run[i]->owner->pml4, run[i]->va, true);
+		return 0;
+	}
+	return cnt;
+}
+
+/* Writes back the dirty pages of the current process's file
+ * mappings in the LENGTH bytes from page-aligned ADDR.  Returns
+ * false if ADDR is misaligned or a write fails. */
+bool
+file_msync (void *addr, size_t length) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	uint8_t *end = (uint8_t *) addr + ROUND_UP (length, PGSIZE);
+	bool success = true;
+	uint8_t *va;
+
+	if (pg_ofs (addr) != 0 || end < (uint8_t *) addr)
+		return false;
+
+	lock_acquire (&vm_lock);
+	for (va = addr; va < end; va += PGSIZE) {
+		struct page *page = spt_find_page (spt, va);
+		size_t cnt;
+
+		if (!is_dirty_file_page (page))
+			continue;
+		cnt = flush_run (page);
+		if (cnt == 0)
+			success = false;
+		msync_page_cnt += cnt;
+	}
+	lock_release (&vm_lock);
+	return success;
+}
+
+/* The writeback thread.  It takes VM_LOCK for one frame at a time,
+ * so faults are held up by at most one write. */
+static void
+flusher (void *aux UNUSED) {
+	for (;;) {
+		size_t pages = 0;
+		size_t i;
+
+		timer_sleep (flush_interval);
+		for (i = 0; i < frame_cnt (); i++) {
+			struct frame *frame = frame_at (i);
+			size_t cnt;
+
+			lock_acquire (&vm_lock);
+			if ((frame->flags & (FRAME_USED | FRAME_TEXT)) == FRAME_USED
+					&& is_dirty_file_page (frame->page)
+					&& frame->page->frame == frame
+					&& (cnt = flush_run (frame->page)) > 0) {
+				pages += cnt;
+				flush_write_cnt++;
+			}
+			lock_release (&vm_lock);
+		}
+
+		if (pages > 0) {
+			flush_cnt++;
+			flush_page_cnt += pages;
+			if (pages > flush_page_max)
+				flush_page_max = pages;
+		}
+	}
+}
+
+/* Starts the writeback thread, unless -flush=0 was given. */
+void
+flusher_start (void) {
+	if (flush_interval > 0)
+		thread_create ("flusher", PRI_DEFAULT, flusher, NULL);
+}
+
+/* Prints writeback statistics. */
+void
+file_print_stats (void) {
+	if (flush_cnt > 0)
+		printf ("Writeback: %lld flushes wrote %lld pages in %lld writes, "
+				"%lld pages per flush on average, %zu at most\n",
+				flush_cnt, flush_page_cnt, flush_write_cnt,
+				flush_page_cnt / flush_cnt, flush_page_max);
+	if (msync_page_cnt > 0)
+		printf ("msync: %lld pages written\n", msync_page_cnt);
+}
+
+/* Returns a malloc()'d copy of INFO with its own reopened file,
+ * or a null pointer if memory runs out. */
+struct file_page *
+file_page_dup (const struct file_page *info) {
+	struct file_page *copy = malloc (sizeof *copy);
+
+	if (copy == NULL)
+		return NULL;
+	*copy = *info;
+	copy->file = file_reopen (info->file);
+	if (copy->file == NULL) {
+		free (copy);
+		return NULL;
+	}
+	return copy;
+}
+
+/* Closes the file of INFO, from malloc(), and frees it.  INFO may
+ * be a null pointer. */
+void
+file_page_free (struct file_page *info) {
+	if (info != NULL) {
+		file_close (info->file);
+		free (info);
+	}
+}
+
+/* Do the mmap.  With MAP_POPULATE in WRITABLE, the mapping is
+ * loaded right away, as by MADV_WILLNEED, instead of on faults. */
 void *
 do_mmap (void *addr, size_t length, int writable,
 		struct file *file, off_t offset) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	size_t page_cnt = DIV_ROUND_UP (length, PGSIZE);
+	uint8_t *end = (uint8_t *) addr + page_cnt * PGSIZE;
+	bool populate = (writable & MAP_POPULATE) != 0;
+	off_t file_len;
+	size_t i;
+
+	writable &= ~MAP_POPULATE;
+	if (addr == NULL || pg_ofs (addr) != 0 || length == 0
+			|| offset < 0 || pg_ofs (offset) != 0
+			|| end <= (uint8_t *) addr || !is_user_vaddr (end - 1))
+		return NULL;
+	file_len = file_length (file);
+	if (file_len == 0 || !spt_range_is_free (spt, addr, end))
+		return NULL;
+
+	for (i = 0; i < page_cnt; i++) {
+		uint8_t *upage = (uint8_t *) addr + i * PGSIZE;
+		off_t ofs = offset + i * PGSIZE;
+		struct file_page *info = malloc (sizeof *info);
+
+		if (info == NULL)
+			goto fail;
+		info->file = file_reopen (file);
+		info->ofs = ofs;
+		info->read_bytes = ofs >= file_len ? 0
+			: file_len - ofs < PGSIZE ? (size_t) (file_len - ofs) : PGSIZE;
+		info->map_pages = i == 0 ? page_cnt : 0;
+		info->shared = false;
+		if (info->file == NULL
+				|| !vm_alloc_page_with_initializer (VM_FILE, upage, writable,
+					NULL, info)) {
+			file_page_free (info);
+			goto fail;
+		}
+	}
+	if (populate)
+		vm_madvise (addr, page_cnt * PGSIZE, MADV_WILLNEED);
+	return addr;
+
+fail:
+	vm_unmap_range (addr, i);
+	return NULL;
 }
 
 /* Do the munmap */
 void
 do_munmap (void *addr) {
+	struct page *page = spt_find_page (&thread_current ()->spt, addr);
+	struct file_page *info;
+
+	if (page == NULL || page_get_type (page) != VM_FILE)
+		return;
+	info = VM_TYPE (page->operations->type) == VM_UNINIT
+		? page->uninit.aux : &page->file;
+	if (info->map_pages > 0)
+		vm_unmap_range (addr, info->map_pages);
 }
@@ -0,0 +1,162 @@
+/* frame.c: Per-frame metadata for the user pool.
+ *
+ * Like Linux's mem_map, MEM_MAP holds one struct frame for every
+ * page the user pool can hand out, in physical order, so the
+ * frame of a kernel virtual address is found by indexing rather
+ * than searching:
+ *
+ *     frame_of (kva) == &mem_map[(kva - base) >> PGBITS]
+ *
+ * The array is allocated once at boot and entries are never
+ * created or destroyed, only marked in use by frame_alloc() and
+ * released by frame_free(), so eviction, sharing and copy-on-write
+ * never have to allocate memory to track a frame.
+ *
+ * Every frame in use is also on one of the two replacement lists
+ * of the 2Q policy: FRAME_A1IN from frame_alloc() on, or FRAME_AM
+ * once vm/vm.c finds it hot.  The clock policy ignores them. */
+
+#include "vm/frame.h"
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+#include "vm/vm.h"
+
+static struct frame *mem_map;   /* One entry per user pool page. */
+static uint8_t *mem_map_base;   /* Kernel address of MEM_MAP[0]. */
+static size_t mem_map_cnt;      /* Number of entries. */
+
+static struct list lists[2];    /* Indexed by enum frame_list. */
+static size_t list_cnt[2];      /* Frames on each. */
+
+/* Allocates MEM_MAP to cover every page the user pool may own. */
+void
+frame_init (void) {
+	size_t i;
+
+	list_init (&lists[FRAME_A1IN]);
+	list_init (&lists[FRAME_AM]);
+	palloc_user_span ((void **) &mem_map_base, &mem_map_cnt);
+	mem_map = palloc_get_multiple (PAL_ASSERT | PAL_ZERO,
+			DIV_ROUND_UP (mem_map_cnt * sizeof *mem_map, PGSIZE));
+	for (i = 0; i < mem_map_cnt; i++)
+		mem_map[i].kva = mem_map_base + i * PGSIZE;
+}
+
+/* Returns the frame for the page at kernel virtual address KVA,
+ * which must come from the user pool. */
+struct frame *
+frame_of (const void *kva) {
+	size_t idx = ((const uint8_t *) kva - mem_map_base) >> PGBITS;
+
+	ASSERT (pg_ofs (kva) == 0);
+	ASSERT ((const uint8_t *) kva >= mem_map_base && idx < mem_map_cnt);
+	return &mem_map[idx];
+}
+
+/* Returns the frame at index IDX of MEM_MAP, for walking all of
+ * them in physical order. */
+struct frame *
+frame_at (size_t idx) {
+	ASSERT (idx < mem_map_cnt);
+	return &mem_map[idx];
+}
+
+/* Returns the number of entries in MEM_MAP. */
+size_t
+frame_cnt (void) {
+	return mem_map_cnt;
+}
+
+/* Obtains a free user page and returns its frame, with no page
+ * attached and a reference count of 1, at the back of FRAME_A1IN.
+ * The frame is pinned, so eviction leaves it alone until the
+ * caller has filled and mapped it.  Returns a null pointer if the
+ * user pool is exhausted. */
+struct frame *
+frame_alloc (void) {
+	return frame_alloc_multiple (1);
+}
+
+/* Obtains CNT physically contiguous free user pages, set up as by
+ * frame_alloc(), and returns the first frame; the others follow it
+ * in the frame table and in kernel virtual memory.  Returns a null
+ * pointer if there is no such run. */
+struct frame *
+frame_alloc_multiple (size_t cnt) {
+	uint8_t *kva = palloc_get_multiple (PAL_USER, cnt);
+	struct frame *first;
+	size_t i;
+
+	if (kva == NULL)
+		return NULL;
+	first = frame_of (kva);
+	for (i = 0; i < cnt; i++) {
+		struct frame *frame = first + i;
+		ASSERT (!(frame->flags & FRAME_USED));
+		frame->page = NULL;
+		frame->ref_cnt = 1;
+		frame->flags = FRAME_USED | FRAME_PINNED;
+		list_push_back (&lists[FRAME_A1IN], &frame->lru);
+		list_cnt[FRAME_A1IN]++;
+	}
+	return first;
+}
+
+/* Gives FRAME's page back to the user pool. */
+void
+frame_free (struct frame *frame) {
+	ASSERT (frame->flags & FRAME_USED);
+	frame_list_remove (frame);
+	frame->page = NULL;
+	frame->ref_cnt = 0;
+	frame->flags = 0;
+	palloc_free_page (frame->kva);
+}
+
+/* Returns the list FRAME is on. */
+static enum frame_list
+list_of (const struct frame *frame) {
+	return frame->flags & FRAME_HOT ? FRAME_AM : FRAME_A1IN;
+}
+
+/* Moves FRAME, which is in use, to the back of LIST, from wherever
+ * it was on either list. */
+void
+frame_list_move (struct frame *frame, enum frame_list list) {
+	ASSERT (frame->flags & FRAME_USED);
+	frame_list_remove (frame);
+	if (list == FRAME_AM)
+		frame->flags |= FRAME_HOT;
+	list_push_back (&lists[list], &frame->lru);
+	list_cnt[list]++;
+}
+
+/* Takes FRAME off its replacement list, if it is on one. */
+void
+frame_list_remove (struct frame *frame) {
+	if (frame->lru.prev == NULL)
+		return;
+	list_remove (&frame->lru);
+	list_cnt[list_of (frame)]--;
+	frame->lru.prev = frame->lru.next = NULL;
+	frame->flags &= ~FRAME_HOT;
+}
+
+/* Returns the frame at the front of LIST, or a null pointer if
+ * LIST is empty. */
+struct frame *
+frame_list_front (enum frame_list list) {
+	if (list_empty (&lists[list]))
+		return NULL;
+	return list_entry (list_front (&lists[list]), struct frame, lru);
+}
+
+/* Returns the number of frames on LIST. */
+size_t
+frame_list_size (enum frame_list list) {
+	return list_cnt[list];
+}
@@ -0,0 +1,211 @@
+/* ksm.c: Same-page merging for anonymous memory.
+ *
+ * A low-priority kernel thread, "ksmd", walks the frame table a
+ * few frames at a time, hashes the contents of each anonymous
+ * frame, and looks the hash up in a table of frames seen so far
+ * in the current pass.  When two frames turn out to hold the same
+ * bytes, the page in one is remapped to the other, read-only, and
+ * its frame is freed; a later write copies it again through the
+ * copy-on-write path in vm_handle_wp().  Pages of zeros are merged
+ * into the shared zero frame.
+ *
+ * The table is rebuilt from scratch on every pass, so its entries
+ * may name frames that have since been freed or reused.  Each hit
+ * is therefore checked again, and the contents compared byte for
+ * byte, with both pages write-protected so that their owners
+ * cannot change them in the meantime. */
+
+#include "vm/ksm.h"
+#include <debug.h>
+#include <hash.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "vm/frame.h"
+#include "vm/vm.h"
+
+/* Rate limit: frames looked at per wakeup, and ticks between. */
+#define KSM_BATCH 64
+#define KSM_SLEEP 10
+
+/* Set by the -ksm kernel option. */
+bool ksm_enabled;
+
+/* A frame seen in the current pass, by hash of its contents. */
+struct ksm_item {
+	struct hash_elem elem;
+	uint64_t sum;               /* hash_bytes() of the contents. */
+	struct frame *frame;
+};
+
+static struct hash ksm_table;
+static size_t ksm_hand;                 /* Next frame to look at. */
+
+/* Statistics. */
+static long long ksm_pass_cnt;          /* Full passes. */
+static long long ksm_scan_cnt;          /* Frames looked at. */
+static long long ksm_merge_cnt;         /* Pages merged... */
+static long long ksm_zero_cnt;          /* ...of which into zeros. */
+static long long ksm_ticks;             /* Ticks spent scanning. */
+
+static uint64_t
+ksm_hash (const struct hash_elem *e, void *aux UNUSED) {
+	return hash_entry (e, struct ksm_item, elem)->sum;
+}
+
+static bool
+ksm_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	return hash_entry (a, struct ksm_item, elem)->sum
+		< hash_entry (b, struct ksm_item, elem)->sum;
+}
+
+static void
+ksm_item_free (struct hash_elem *e, void *aux UNUSED) {
+	free (hash_entry (e, struct ksm_item, elem));
+}
+
+/* Adds FRAME, whose contents hash to SUM, to the table. */
+static void
+ksm_add (struct frame *frame, uint64_t sum) {
+	struct ksm_item *item = malloc (sizeof *item);
+
+	if (item != NULL) {
+		item->sum = sum;
+		item->frame = frame;
+		hash_insert (&ksm_table, &item->elem);
+	}
+}
+
+/* Returns true if FRAME holds anonymous memory that pages can be
+ * merged into: in use, not under I/O, and either the zero frame,
+ * an anonymous page's, or shared copy-on-write. */
+static bool
+is_merge_target (struct frame *frame) {
+	if ((frame->flags & (FRAME_USED | FRAME_PINNED | FRAME_TEXT
+					| FRAME_SWAPCACHE)) != FRAME_USED)
+		return false;
+	return frame->page == NULL
+		|| VM_TYPE (frame->page->operations->type) == VM_ANON;
+}
+
+/* Makes the page in FRAME read-only, if FRAME has a single known
+ * mapping; frames with other mappings are read-only already. */
+static void
+protect (struct frame *frame) {
+	struct page *page = frame->page;
+
+	if (page != NULL && frame->ref_cnt == 1)
+		pml4_set_writable (page->owner->pml4, page->va, false);
+}
+
+/* Undoes protect (FRAME). */
+static void
+unprotect (struct frame *frame) {
+	struct page *page = frame->page;
+
+	if (page != NULL && frame->ref_cnt == 1 && page->writable)
+		pml4_set_writable (page->owner->pml4, page->va, true);
+}
+
+/* Merges PAGE into frame INTO if they hold the same bytes. */
+static bool
+ksm_try_merge (struct page *page, struct frame *into) {
+	struct frame *frame = page->frame;
+
+	if (into == frame || !is_merge_target (into))
+		return false;
+
+	protect (frame);
+	protect (into);
+	if (memcmp (frame->kva, into->kva, PGSIZE)) {
+		unprotect (frame);
+		unprotect (into);
+		return false;
+	}
+	vm_merge_frame (page, into);
+	ksm_merge_cnt++;
+	if (into == vm_zero_frame ())
+		ksm_zero_cnt++;
+	return true;
+}
+
+/* Looks at up to CNT frames from the hand on. */
+static void
+ksm_scan (size_t cnt) {
+	while (cnt-- > 0) {
+		struct frame *frame;
+		struct page *page;
+		struct ksm_item key;
+		struct hash_elem *e;
+
+		/* Start a new pass with a fresh table, holding just the
+		 * zero frame. */
+		if (ksm_hand == 0) {
+			struct frame *zero = vm_zero_frame ();
+			hash_clear (&ksm_table, ksm_item_free);
+			ksm_add (zero, hash_bytes (zero->kva, PGSIZE));
+			ksm_pass_cnt++;
+		}
+		frame = frame_at (ksm_hand);
+		if (++ksm_hand == frame_cnt ())
+			ksm_hand = 0;
+
+		/* Only a private, loaded anonymous page can be merged. */
+		page = frame->page;
+		if (!is_merge_target (frame) || page == NULL
+				|| frame->ref_cnt != 1 || page->frame != frame)
+			continue;
+		ksm_scan_cnt++;
+
+		key.sum = hash_bytes (frame->kva, PGSIZE);
+		e = hash_find (&ksm_table, &key.elem);
+		if (e == NULL)
+			ksm_add (frame, key.sum);
+		else {
+			struct ksm_item *item = hash_entry (e, struct ksm_item, elem);
+			if (!ksm_try_merge (page, item->frame)
+					&& !is_merge_target (item->frame))
+				item->frame = frame;
+		}
+	}
+}
+
+/* The merging thread. */
+static void
+ksmd (void *aux UNUSED) {
+	for (;;) {
+		int64_t start;
+
+		timer_sleep (KSM_SLEEP);
+		start = timer_ticks ();
+		lock_acquire (&vm_lock);
+		ksm_scan (KSM_BATCH);
+		lock_release (&vm_lock);
+		ksm_ticks += timer_ticks () - start;
+	}
+}
+
+/* Starts the merging thread, if the -ksm option was given. */
+void
+ksm_start (void) {
+	if (!ksm_enabled)
+		return;
+	if (!hash_init (&ksm_table, ksm_hash, ksm_less, NULL))
+		PANIC ("ksm_start: cannot allocate hash table");
+	thread_create ("ksmd", PRI_MIN, ksmd, NULL);
+}
+
+/* Prints merging statistics. */
+void
+ksm_print_stats (void) {
+	if (ksm_enabled)
+		printf ("KSM: %lld passes, %lld frames scanned, %lld pages merged "
+				"(%lld into zeros), %lld ticks\n", ksm_pass_cnt, ksm_scan_cnt,
+				ksm_merge_cnt, ksm_zero_cnt, ksm_ticks);
+}
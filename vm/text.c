@@ -0,0 +1,174 @@
+/* text.c: Cache of read-only executable text pages.
+ *
+ * Processes running the same program map the same frames for its
+ * text, found here by (inode, offset) when a text page faults,
+ * instead of reading and holding one copy per process.  Each cached
+ * page lists the pages mapping it, so eviction can unmap it from
+ * all of them at once.  A page leaves the cache when its last
+ * mapper goes away, and its frame is freed with it.
+ *
+ * The cache is protected by the VM lock in vm/vm.c. */
+
+#include "vm/text.h"
+#include <debug.h>
+#include <stdio.h>
+#include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "vm/frame.h"
+#include "vm/vm.h"
+
+static struct hash text_pages;
+
+/* Statistics. */
+static long long text_read_cnt;         /* Pages read into the cache. */
+static long long text_hit_cnt;          /* Faults that found one. */
+static long long text_evict_cnt;        /* Pages evicted. */
+
+static uint64_t
+text_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct text_page *t = hash_entry (e, struct text_page, elem);
+	return hash_int (inode_get_inumber (t->inode)) ^ hash_int (t->ofs);
+}
+
+static bool
+text_less (const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux UNUSED) {
+	const struct text_page *a = hash_entry (a_, struct text_page, elem);
+	const struct text_page *b = hash_entry (b_, struct text_page, elem);
+
+	if (a->inode != b->inode)
+		return a->inode < b->inode;
+	return a->ofs < b->ofs;
+}
+
+/* Initializes the text cache. */
+void
+text_init (void) {
+	if (!hash_init (&text_pages, text_hash, text_less, NULL))
+		PANIC ("text_init: cannot allocate text cache");
+}
+
+/* Returns the cached page at offset OFS of INODE, or a null
+ * pointer if there is none, without counting a hit. */
+static struct text_page *
+text_lookup (struct inode *inode, off_t ofs) {
+	struct text_page key;
+	struct hash_elem *e;
+
+	key.inode = inode;
+	key.ofs = ofs;
+	e = hash_find (&text_pages, &key.elem);
+	return e != NULL ? hash_entry (e, struct text_page, elem) : NULL;
+}
+
+/* Returns the cached page at offset OFS of INODE, or a null
+ * pointer if there is none. */
+struct text_page *
+text_find (struct inode *inode, off_t ofs) {
+	struct text_page *t = text_lookup (inode, ofs);
+
+	if (t != NULL)
+		text_hit_cnt++;
+	return t;
+}
+
+/* Returns true if the page at offset OFS of INODE is cached.  Unlike
+ * text_find(), this is not counted as a hit. */
+bool
+text_cached (struct inode *inode, off_t ofs) {
+	return text_lookup (inode, ofs) != NULL;
+}
+
+/* Adds FRAME, just filled with the page at offset OFS of INODE, to
+ * the cache, with no mappers yet.  Returns the new entry, or a null
+ * pointer if memory runs out. */
+struct text_page *
+text_insert (struct inode *inode, off_t ofs, struct frame *frame) {
+	struct text_page *t = malloc (sizeof *t);
+
+	if (t == NULL)
+		return NULL;
+	t->inode = inode;
+	t->ofs = ofs;
+	t->frame = frame;
+	list_init (&t->mappers);
+	hash_insert (&text_pages, &t->elem);
+	frame->text = t;
+	frame->flags |= FRAME_TEXT;
+	frame->ref_cnt = 0;
+	text_read_cnt++;
+	return t;
+}
+
+/* Records that PAGE maps T. */
+void
+text_map (struct text_page *t, struct page *page) {
+	list_push_back (&t->mappers, &page->text_elem);
+	page->text = t;
+	page->frame = t->frame;
+	t->frame->ref_cnt++;
+}
+
+/* Removes PAGE, whose mapping the caller clears, from the mappers
+ * of T.  If it was the last, drops T from the cache and returns
+ * true; the caller then frees T's frame. */
+bool
+text_unmap (struct text_page *t, struct page *page) {
+	ASSERT (page->text == t);
+
+	list_remove (&page->text_elem);
+	page->text = NULL;
+	page->frame = NULL;
+	if (--t->frame->ref_cnt > 0)
+		return false;
+
+	hash_delete (&text_pages, &t->elem);
+	t->frame->text = NULL;
+	t->frame->flags &= ~FRAME_TEXT;
+	free (t);
+	return true;
+}
+
+/* Unmaps T from every page mapping it, all of them clean, and
+ * drops it from the cache, leaving its frame to the caller. */
+void
+text_evict (struct text_page *t) {
+	struct frame *frame = t->frame;
+	struct page *page;
+
+	/* The last text_unmap() frees T. */
+	do {
+		page = list_entry (list_front (&t->mappers), struct page, text_elem);
+		pml4_clear_page (page->owner->pml4, page->va);
+	} while (!text_unmap (t, page));
+	frame->ref_cnt = 1;
+	text_evict_cnt++;
+}
+
+/* Returns true if any page mapping T was accessed since the last
+ * call, clearing their accessed bits, as the clock does for a page
+ * with a single mapping. */
+bool
+text_clear_accessed (struct text_page *t) {
+	bool accessed = false;
+	struct list_elem *e;
+
+	for (e = list_begin (&t->mappers); e != list_end (&t->mappers);
+			e = list_next (e)) {
+		struct page *page = list_entry (e, struct page, text_elem);
+		if (pml4_is_accessed (page->owner->pml4, page->va)) {
+			pml4_set_accessed (page->owner->pml4, page->va, false);
+			accessed = true;
+		}
+	}
+	return accessed;
+}
+
+/* Prints text cache statistics. */
+void
+text_print_stats (void) {
+	if (text_read_cnt > 0)
+		printf ("Text cache: %lld pages read, %lld faults shared one, "
+				"%lld evicted\n", text_read_cnt, text_hit_cnt, text_evict_cnt);
+}
@@ -1,8 +1,122 @@
 /* vm.c: Generic interface for virtual memory objects. */
 
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall-nr.h>
+#include "devices/timer.h"
+#include "filesys/file.h"
 #include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 #include "vm/vm.h"
+#include "vm/frame.h"
 #include "vm/inspect.h"
+#include "vm/ksm.h"
+
+/* Lowest address the stack may grow down to. */
+#define STACK_MAX (1 << 20)
+
+/* Supplemental page table statistics, gathered as address spaces
+ * are torn down. */
+static long long spt_tables;            /* Tables torn down. */
+static size_t spt_peak_nodes;           /* Most nodes in one table. */
+static size_t spt_peak_pages;           /* Most pages left at teardown. */
+static long long spt_total_nodes;       /* Sum of per-table peaks. */
+
+/* Serializes claiming, evicting and freeing frames.  Eviction
+ * reaches into other processes' pages, so a fault or a teardown
+ * holds it while it changes which frame backs a page. */
+struct lock vm_lock;
+
+/* The replacement policy, chosen with the -replace kernel
+ * option. */
+enum evict_policy evict_policy = EVICT_CLOCK;
+
+/* Print each process's major faults when it exits?  Set with the
+ * -faultstats kernel option, for comparing policies. */
+bool fault_stats;
+
+/* The clock hand: index in the frame table of the next frame
+ * vm_get_victim() looks at. */
+static size_t clock_hand;
+
+/* The 2Q policy (Johnson and Shasha, 1994).  A frame starts out on
+ * FRAME_A1IN, a FIFO, and is taken when it reaches the front
+ * whether it was used or not, so the pages of a scan, used once,
+ * go no further.  A page evicted from A1in is remembered as a
+ * ghost, by the number of A1in evictions at the time; if it faults
+ * back in while it is among the last half as many ghosts as there
+ * are frames in use, it has shown it is reused and its frame goes
+ * on FRAME_AM, whose frames get second chances in LRU order.
+ * Victims come from A1in while it holds over a quarter of the
+ * frames in use, and from Am otherwise. */
+static unsigned twoq_seq;               /* Evictions from A1in. */
+static long long twoq_cold_cnt;         /* Victims from A1in... */
+static long long twoq_hot_cnt;          /* ...and from Am. */
+static long long twoq_promote_cnt;      /* Ghosts that faulted back. */
+
+/* Eviction statistics. */
+static long long evict_cnt;             /* Frames evicted. */
+static long long evict_dirty_cnt;       /* ...of which were dirty... */
+static long long evict_shared_cnt;      /* ...or shared... */
+static long long evict_sharer_cnt;      /* ...by this many pages. */
+static long long evict_scan_cnt;        /* Frames looked at in total. */
+static size_t evict_scan_max;           /* Longest single scan. */
+
+/* Background reclaim.  "kswapd" sleeps until the first fault that
+ * has to evict for itself, so that machines never short of memory
+ * never run it.  From then on it checks free user memory every
+ * KSWAPD_SLEEP ticks, and at once after another such fault;
+ * whenever fewer than KSWAPD_LOW pages are free it evicts until
+ * KSWAPD_HIGH are, so that faults usually find a free frame
+ * instead of waiting for a swap-out.  The -nokswapd kernel option
+ * turns it off. */
+#define KSWAPD_LOW 32
+#define KSWAPD_HIGH 64
+#define KSWAPD_SLEEP 4
+bool kswapd_enabled = true;
+static struct semaphore kswapd_start_sema;
+static bool kswapd_started;             /* Up'ed KSWAPD_START_SEMA? */
+static bool kswapd_kick;                /* A fault reclaimed directly. */
+static long long kswapd_wake_cnt;       /* Times it reclaimed... */
+static long long kswapd_evict_cnt;      /* ...and frames it evicted. */
+static long long direct_stall_cnt;      /* Faults that reclaimed... */
+static long long direct_evict_cnt;      /* ...and frames they evicted. */
+
+/* Reverse mapping.  The pages that map a frame are chained from
+ * FRAME->page through PAGE->rmap_next, so that eviction can unmap
+ * a frame shared copy-on-write or merged by KSM from all of them.
+ * The zero frame, which is never evicted, keeps no chain, and
+ * shared text keeps its own list of mappers in vm/text.c. */
+
+/* A frame of zeros, mapped read-only for reads of anonymous pages
+ * that have never been written.  It holds a reference of its own,
+ * so it is never freed, and it stays pinned. */
+static struct frame *zero_frame;
+static long long zero_map_cnt;          /* Read faults it served. */
+static long long zero_copy_cnt;         /* ...later written to. */
+
+/* Pages fault-around may map per fault, including the faulting
+ * one; the window is aligned to this many pages.  Set with the
+ * -fault-around kernel option; 1 disables it. */
+#define FAULT_AROUND_MAX 16
+size_t fault_around_pages = 8;
+static long long around_cnt;            /* Faults that read around. */
+static long long around_mapped_cnt;     /* Extra pages they mapped. */
+static long long around_used_cnt;       /* ...that were then used. */
+
+/* madvise() statistics. */
+static long long advise_load_cnt;       /* Pages loaded by WILLNEED. */
+static long long advise_evict_cnt;      /* Pages paged out by DONTNEED. */
+
+/* Copy-on-write statistics. */
+static long long cow_share_cnt;         /* Frames shared by fork. */
+static long long cow_copy_cnt;          /* Write faults that copied. */
+static long long cow_reuse_cnt;         /* ...that took the frame over. */
 
 /* Initializes the virtual memory subsystem by invoking each subsystem's
  * intialize codes. */
@@ -15,7 +129,14 @@ vm_init (void) {
 #endif
 	register_inspect_intr ();
 	/* DO NOT MODIFY UPPER LINES. */
-	/* TODO: Your code goes here. */
+	frame_init ();
+	text_init ();
+	lock_init (&vm_lock);
+	zero_frame = frame_alloc ();
+	if (zero_frame == NULL)
+		PANIC ("vm_init: no frame for the zero page");
+	memset (zero_frame->kva, 0, PGSIZE);
+	frame_list_remove (zero_frame);
 }
 
 /* Get the type of the page. This function is useful if you want to know the
@@ -36,6 +157,9 @@ page_get_type (struct page *page) {
 static struct frame *vm_get_victim (void);
 static bool vm_do_claim_page (struct page *page);
 static struct frame *vm_evict_frame (void);
+static void frame_get (struct frame *, struct page *);
+static bool frame_put (struct frame *, struct page *);
+static void account_ahead (struct page *);
 
 /* Create the pending page object with initializer. If you want to create a
  * page, do not create it directly and make it through this function or
@@ -50,94 +174,1128 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 
 	/* Check wheter the upage is already occupied or not. */
 	if (spt_find_page (spt, upage) == NULL) {
-		/* TODO: Create the page, fetch the initialier according to the VM type,
-		 * TODO: and then create "uninit" page struct by calling uninit_new. You
-		 * TODO: should modify the field after calling the uninit_new. */
+		bool (*initializer) (struct page *, enum vm_type, void *);
+		struct page *page;
+
+		switch (VM_TYPE (type)) {
+			case VM_ANON:
+				initializer = anon_initializer;
+				break;
+			case VM_FILE:
+				initializer = file_backed_initializer;
+				break;
+			default:
+				goto err;
+		}
 
-		/* TODO: Insert the page into the spt. */
+		page = malloc (sizeof *page);
+		if (page == NULL)
+			goto err;
+		uninit_new (page, upage, init, type, aux, initializer);
+		page->owner = thread_current ();
+		page->writable = writable;
+
+		if (!spt_insert_page (spt, page)) {
+			free (page);
+			goto err;
+		}
+		return true;
 	}
 err:
 	return false;
 }
 
+/* Returns the index into a level-LEVEL node of the radix tree for
+ * VA.  Level 0 is the root. */
+static inline size_t
+spt_index (const void *va, int level) {
+	switch (level) {
+		case 0: return PML4 (va);
+		case 1: return PDPE (va);
+		case 2: return PDX (va);
+		default: return PTX (va);
+	}
+}
+
+/* Returns the number of bytes covered by one entry of a level-LEVEL
+ * node. */
+static inline uint64_t
+spt_span (int level) {
+	return (uint64_t) PGSIZE << (9 * (3 - level));
+}
+
+/* Returns the node an interior entry ENTRY points to. */
+static inline uintptr_t *
+spt_node (uintptr_t entry) {
+	return (uintptr_t *) (entry & ~(uintptr_t) PGMASK);
+}
+
+/* Allocates an empty node for SPT. */
+static uintptr_t *
+spt_node_alloc (struct supplemental_page_table *spt) {
+	uintptr_t *node = palloc_get_page (PAL_ZERO);
+
+	if (node != NULL && ++spt->node_cnt > spt->peak_node_cnt)
+		spt->peak_node_cnt = spt->node_cnt;
+	return node;
+}
+
+/* Frees NODE of SPT. */
+static void
+spt_node_free (struct supplemental_page_table *spt, uintptr_t *node) {
+	palloc_free_page (node);
+	spt->node_cnt--;
+}
+
 /* Find VA from spt and return page. On error, return NULL. */
 struct page *
-spt_find_page (struct supplemental_page_table *spt UNUSED, void *va UNUSED) {
-	struct page *page = NULL;
-	/* TODO: Fill this function. */
+spt_find_page (struct supplemental_page_table *spt, void *va) {
+	uintptr_t *node = spt->root;
+	int level;
 
-	return page;
+	for (level = 0; node != NULL && level < 3; level++)
+		node = spt_node (node[spt_index (va, level)]);
+	return node != NULL ? (struct page *) node[spt_index (va, 3)] : NULL;
 }
 
 /* Insert PAGE into spt with validation. */
 bool
-spt_insert_page (struct supplemental_page_table *spt UNUSED,
-		struct page *page UNUSED) {
-	int succ = false;
-	/* TODO: Fill this function. */
+spt_insert_page (struct supplemental_page_table *spt,
+		struct page *page) {
+	uintptr_t *cnt_entry[4];    /* Entries counting each node's children. */
+	uintptr_t *node;
+	uintptr_t *slot;
+	int level;
 
-	return succ;
+	ASSERT (pg_ofs (page->va) == 0);
+	if (spt->root == NULL && (spt->root = spt_node_alloc (spt)) == NULL)
+		return false;
+
+	/* Walk down, adding missing nodes.  A node's child count lives
+	 * in the entry that points to it; the root's is ROOT_CNT. */
+	node = spt->root;
+	cnt_entry[0] = NULL;
+	for (level = 0; level < 3; level++) {
+		slot = &node[spt_index (page->va, level)];
+		if (*slot == 0) {
+			uintptr_t *child = spt_node_alloc (spt);
+			if (child == NULL)
+				return false;
+			*slot = (uintptr_t) child;
+			if (cnt_entry[level] != NULL)
+				(*cnt_entry[level])++;
+			else
+				spt->root_cnt++;
+		}
+		cnt_entry[level + 1] = slot;
+		node = spt_node (*slot);
+	}
+
+	slot = &node[spt_index (page->va, 3)];
+	if (*slot != 0)
+		return false;
+	*slot = (uintptr_t) page;
+	(*cnt_entry[3])++;
+	spt->page_cnt++;
+	return true;
 }
 
+/* Removes PAGE from SPT, freeing any node left empty, then frees
+ * PAGE. */
 void
 spt_remove_page (struct supplemental_page_table *spt, struct page *page) {
+	uintptr_t *slots[4];        /* Entry followed at each level. */
+	uintptr_t *node = spt->root;
+	int level;
+
+	for (level = 0; level < 4; level++) {
+		ASSERT (node != NULL);
+		slots[level] = &node[spt_index (page->va, level)];
+		node = spt_node (*slots[level]);
+	}
+	ASSERT ((struct page *) *slots[3] == page);
+
+	/* Clear the leaf entry, then walk up dropping child counts and
+	 * freeing nodes whose count reaches zero. */
+	*slots[3] = 0;
+	spt->page_cnt--;
+	for (level = 2; level >= 0; level--) {
+		if (--*slots[level] & PGMASK)
+			break;
+		spt_node_free (spt, spt_node (*slots[level]));
+		*slots[level] = 0;
+	}
+	if (level < 0 && --spt->root_cnt == 0) {
+		spt_node_free (spt, spt->root);
+		spt->root = NULL;
+	}
+
 	vm_dealloc_page (page);
+}
+
+/* Calls ACTION on each page of level-LEVEL node NODE, whose first
+ * entry covers address BASE, that lies in [START, END), in address
+ * order.  Returns false if ACTION stopped the walk. */
+static bool
+spt_walk (uintptr_t *node, int level, uint64_t base,
+		uint64_t start, uint64_t end, spt_action_func *action, void *aux) {
+	uint64_t span = spt_span (level);
+	size_t i = start > base ? (start - base) / span : 0;
+
+	for (; i < 512 && base + i * span < end; i++) {
+		if (node[i] == 0)
+			continue;
+		if (level == 3) {
+			if (!action ((struct page *) node[i], aux))
+				return false;
+		} else if (!spt_walk (spt_node (node[i]), level + 1, base + i * span,
+					start, end, action, aux))
+			return false;
+	}
 	return true;
 }
 
-/* Get the struct frame, that will be evicted. */
+/* Calls ACTION with AUX on every page of SPT in [START, END), in
+ * address order, visiting only the nodes that exist.  ACTION may
+ * not change SPT.  Returns false if ACTION returned false. */
+bool
+spt_for_each (struct supplemental_page_table *spt, void *start, void *end,
+		spt_action_func *action, void *aux) {
+	if (spt->root == NULL)
+		return true;
+	return spt_walk (spt->root, 0, 0, (uint64_t) start, (uint64_t) end,
+			action, aux);
+}
+
+/* spt_for_each() action that finds any page at all. */
+static bool
+spt_stop (struct page *page UNUSED, void *aux UNUSED) {
+	return false;
+}
+
+/* Returns true if SPT has no page in [START, END), for example
+ * before inserting a whole mmap region. */
+bool
+spt_range_is_free (struct supplemental_page_table *spt,
+		void *start, void *end) {
+	return spt_for_each (spt, start, end, spt_stop, NULL);
+}
+
+/* Removes and frees every page in [START, END) of level-LEVEL node
+ * NODE, whose first entry covers BASE, calling ACTION on each page
+ * first; its return value is ignored.  Emptied nodes below NODE are
+ * freed.  Returns the number of entries cleared in NODE. */
+static size_t
+spt_clear (struct supplemental_page_table *spt, uintptr_t *node, int level,
+		uint64_t base, uint64_t start, uint64_t end,
+		spt_action_func *action, void *aux) {
+	uint64_t span = spt_span (level);
+	size_t i = start > base ? (start - base) / span : 0;
+	size_t cleared = 0;
+
+	for (; i < 512 && base + i * span < end; i++) {
+		if (node[i] == 0)
+			continue;
+		if (level == 3) {
+			struct page *page = (struct page *) node[i];
+			node[i] = 0;
+			spt->page_cnt--;
+			cleared++;
+			if (action != NULL)
+				action (page, aux);
+			vm_dealloc_page (page);
+		} else {
+			uintptr_t *child = spt_node (node[i]);
+			node[i] -= spt_clear (spt, child, level + 1, base + i * span,
+					start, end, action, aux);
+			if ((node[i] & PGMASK) == 0) {
+				spt_node_free (spt, child);
+				node[i] = 0;
+				cleared++;
+			}
+		}
+	}
+	return cleared;
+}
+
+/* Removes and frees all pages of SPT in [START, END), calling
+ * ACTION on each one before it is freed. */
+static void
+spt_remove_range (struct supplemental_page_table *spt, void *start, void *end,
+		spt_action_func *action, void *aux) {
+	if (spt->root == NULL)
+		return;
+	spt->root_cnt -= spt_clear (spt, spt->root, 0, 0, (uint64_t) start,
+			(uint64_t) end, action, aux);
+	if (spt->root_cnt == 0) {
+		spt_node_free (spt, spt->root);
+		spt->root = NULL;
+	}
+}
+
+/* Clears the accessed bits of all the pages mapping FRAME.  Returns
+ * true if one of them had been used and so earns FRAME a second
+ * chance.  Pages of a sequential scan get none: they were used
+ * once and will not be again soon. */
+static bool
+frame_clear_accessed (struct frame *frame) {
+	bool accessed = false;
+	struct page *p;
+
+	for (p = frame->page; p != NULL; p = p->rmap_next) {
+		uint64_t *pml4 = p->owner->pml4;
+		if (pml4_is_accessed (pml4, p->va)) {
+			account_ahead (p);
+			pml4_set_accessed (pml4, p->va, false);
+			if (p->advice != MADV_SEQUENTIAL)
+				accessed = true;
+		}
+	}
+	return accessed;
+}
+
+/* Returns true if one of the pages mapping FRAME is dirty. */
+static bool
+frame_is_dirty (struct frame *frame) {
+	struct page *p;
+
+	for (p = frame->page; p != NULL; p = p->rmap_next)
+		if (pml4_is_dirty (p->owner->pml4, p->va))
+			return true;
+	return false;
+}
+
+/* Chooses a victim by the clock.
+ *
+ * Second-chance clock over the frame table, preferring clean
+ * pages: a recently accessed page has its accessed bit cleared
+ * and is passed over, and the first page found neither accessed
+ * nor dirty is taken.  The first one that is only dirty is
+ * remembered, and taken if a whole lap finds nothing clean,
+ * since writing it back costs a disk write.  Two laps always
+ * suffice unless every frame is pinned.  Stores the number of
+ * frames looked at in *SCAN_CNT.  Returns a null pointer if
+ * nothing can be evicted. */
 static struct frame *
-vm_get_victim (void) {
+clock_get_victim (size_t *scan_cnt) {
 	struct frame *victim = NULL;
-	 /* TODO: The policy for eviction is up to you. */
+	struct frame *dirty = NULL;
+	size_t cnt = frame_cnt ();
+	size_t scanned;
+
+	for (scanned = 0; scanned < 2 * cnt; scanned++) {
+		struct frame *frame = frame_at (clock_hand);
+		struct page *page = frame->page;
+
+		if (++clock_hand == cnt)
+			clock_hand = 0;
+		if (scanned == cnt && dirty != NULL) {
+			victim = dirty;
+			break;
+		}
+		if (frame->flags & FRAME_PINNED)
+			continue;
+
+		/* A page read ahead and never used costs nothing to drop. */
+		if (frame->flags & FRAME_SWAPCACHE) {
+			victim = frame;
+			break;
+		}
 
+		/* Shared text is clean, and its mappings are all known. */
+		if (frame->flags & FRAME_TEXT) {
+			if (!text_clear_accessed (frame->text)) {
+				victim = frame;
+				break;
+			}
+			continue;
+		}
+
+		if (page == NULL)
+			continue;
+		if (frame_clear_accessed (frame))
+			continue;
+		if (!frame_is_dirty (frame)) {
+			victim = frame;
+			break;
+		} else if (dirty == NULL)
+			dirty = frame;
+	}
+	if (victim == NULL)
+		victim = dirty;
+	*scan_cnt = scanned;
 	return victim;
 }
 
+/* Chooses a victim by 2Q, see above.  Every frame looked at goes
+ * to the back of its list, so one passed over is not looked at
+ * again before the others.  On A1in only the pinned are passed
+ * over; on Am, also those accessed since last looked at.  Shared
+ * text, which is not claimed through vm_do_claim_page() and so
+ * never reaches Am, gets its second chance on A1in.  Either list
+ * is given up on after two laps, as for the clock.  Stores the
+ * number of frames looked at in *SCANNED.  Returns a null pointer
+ * if nothing can be evicted. */
+static struct frame *
+twoq_get_victim (size_t *scanned) {
+	size_t seen[2] = { 0, 0 };
+
+	for (*scanned = 0; ; ++*scanned) {
+		size_t in_cnt = frame_list_size (FRAME_A1IN);
+		size_t am_cnt = frame_list_size (FRAME_AM);
+		enum frame_list list;
+		struct frame *frame;
+
+		list = in_cnt > (in_cnt + am_cnt) / 4 || am_cnt == 0
+			? FRAME_A1IN : FRAME_AM;
+		if (seen[list] >= 2 * frame_list_size (list))
+			list = list == FRAME_A1IN ? FRAME_AM : FRAME_A1IN;
+		if (seen[list] >= 2 * frame_list_size (list))
+			return NULL;
+		seen[list]++;
+		frame = frame_list_front (list);
+		frame_list_move (frame, list);
+
+		if (frame->flags & FRAME_PINNED)
+			continue;
+		if (frame->flags & FRAME_TEXT) {
+			if (text_clear_accessed (frame->text))
+				continue;
+		} else if (!(frame->flags & FRAME_SWAPCACHE)) {
+			if (frame->page == NULL)
+				continue;
+			if (list == FRAME_AM && frame_clear_accessed (frame))
+				continue;
+		}
+
+		if (list == FRAME_AM)
+			twoq_hot_cnt++;
+		else
+			twoq_cold_cnt++;
+		return frame;
+	}
+}
+
+/* Get the struct frame, that will be evicted, by the policy
+ * chosen at boot.  The victim is returned pinned.  Returns a null
+ * pointer if nothing can be evicted. */
+static struct frame *
+vm_get_victim (void) {
+	struct frame *victim;
+	size_t scanned;
+
+	ASSERT (lock_held_by_current_thread (&vm_lock));
+
+	if (evict_policy == EVICT_2Q)
+		victim = twoq_get_victim (&scanned);
+	else
+		victim = clock_get_victim (&scanned);
+
+	evict_scan_cnt += scanned;
+	if (scanned > evict_scan_max)
+		evict_scan_max = scanned;
+	if (victim != NULL)
+		victim->flags |= FRAME_PINNED;
+	return victim;
+}
+
+/* Puts FRAME, just loaded for PAGE, on the 2Q list it belongs on:
+ * FRAME_AM if PAGE is a recent enough ghost, see above, and
+ * FRAME_A1IN otherwise.  The lists are kept whatever the policy,
+ * so that either can be chosen at boot. */
+static void
+twoq_admit (struct page *page, struct frame *frame) {
+	size_t in_use = frame_list_size (FRAME_A1IN)
+		+ frame_list_size (FRAME_AM);
+
+	if (page->ghost != 0 && twoq_seq - page->ghost < in_use / 2) {
+		frame_list_move (frame, FRAME_AM);
+		twoq_promote_cnt++;
+	} else
+		frame_list_move (frame, FRAME_A1IN);
+	page->ghost = 0;
+}
+
+/* Evicts up to EVICT_BATCH victims at a time.  All but one of
+ * the freed frames go back to the user pool for the next faults,
+ * and the anonymous pages among them go to swap in one run. */
+#define EVICT_BATCH 8
+
+/* Evicts the N pinned frames in CHOSEN, at most EVICT_BATCH.
+ * Returns one of the freed frames, or a null pointer if none could
+ * be freed. */
+static struct frame *
+vm_evict_frames (struct frame *chosen[], size_t n) {
+	struct frame *victims[EVICT_BATCH];
+	struct page *anon[EVICT_BATCH];
+	bool dirty[EVICT_BATCH];
+	struct frame *frame = NULL;
+	bool anon_out[EVICT_BATCH];
+	size_t cnt, anon_cnt, i, k;
+
+	ASSERT (n <= EVICT_BATCH);
+
+	/* Unmap each victim first, so its owner cannot write to the
+	 * page while it is written out.  The PTE keeps its dirty bit.
+	 * Shared text and the swap cache need no writing and are done
+	 * with at once. */
+	cnt = anon_cnt = 0;
+	for (k = 0; k < n; k++) {
+		struct frame *victim = chosen[k];
+
+		if (victim->flags & (FRAME_TEXT | FRAME_SWAPCACHE)) {
+			if (victim->flags & FRAME_TEXT)
+				text_evict (victim->text);
+			else
+				anon_drop_cache (victim);
+			evict_cnt++;
+			if (frame == NULL)
+				frame = victim;
+			else
+				frame_free (victim);
+			continue;
+		}
+
+		struct page *page = victim->page, *p;
+		for (p = page; p != NULL; p = p->rmap_next) {
+			pml4_clear_page (p->owner->pml4, p->va);
+			account_ahead (p);
+		}
+		dirty[cnt] = frame_is_dirty (victim);
+		victims[cnt++] = victim;
+		if (VM_TYPE (page->operations->type) == VM_ANON)
+			anon[anon_cnt++] = page;
+	}
+	anon_swap_out_cluster (anon, anon_cnt, anon_out);
+
+	/* A page that could not be written out, such as an anonymous
+	 * page with swap full, is mapped again, read-only if shared. */
+	anon_cnt = 0;
+	for (i = 0; i < cnt; i++) {
+		struct frame *victim = victims[i];
+		struct page *page = victim->page, *p;
+		unsigned ghost;
+		bool evicted;
+
+		if (VM_TYPE (page->operations->type) == VM_ANON)
+			evicted = anon_out[anon_cnt++];
+		else
+			evicted = swap_out (page);
+
+		if (!evicted) {
+			for (p = page; p != NULL; p = p->rmap_next) {
+				uint64_t *pml4 = p->owner->pml4;
+				if (!pml4_set_page (pml4, p->va, victim->kva,
+							p->writable && victim->ref_cnt == 1))
+					PANIC ("vm_evict_batch: cannot remap %p", p->va);
+				if (dirty[i])
+					pml4_set_dirty (pml4, p->va, true);
+			}
+			victim->flags &= ~FRAME_PINNED;
+			continue;
+		}
+
+		if (victim->ref_cnt > 1) {
+			evict_shared_cnt++;
+			evict_sharer_cnt += victim->ref_cnt;
+		}
+		ghost = victim->flags & FRAME_HOT ? 0 : ++twoq_seq;
+		while (page != NULL) {
+			p = page->rmap_next;
+			page->frame = NULL;
+			page->rmap_next = NULL;
+			page->ghost = ghost;
+			page = p;
+		}
+		victim->page = NULL;
+		victim->ref_cnt = 1;
+		evict_cnt++;
+		if (dirty[i])
+			evict_dirty_cnt++;
+		if (frame == NULL)
+			frame = victim;
+		else
+			frame_free (victim);
+	}
+	return frame;
+}
+
+/* Evicts one batch of victims chosen by vm_get_victim().  Returns
+ * one of the freed frames, or a null pointer if none could be
+ * freed. */
+static struct frame *
+vm_evict_batch (void) {
+	struct frame *chosen[EVICT_BATCH];
+	size_t n;
+
+	for (n = 0; n < EVICT_BATCH; n++)
+		if ((chosen[n] = vm_get_victim ()) == NULL)
+			break;
+	return vm_evict_frames (chosen, n);
+}
+
 /* Evict one page and return the corresponding frame.
  * Return NULL on error.*/
 static struct frame *
 vm_evict_frame (void) {
-	struct frame *victim UNUSED = vm_get_victim ();
-	/* TODO: swap out the victim and return the evicted frame. */
+	struct frame *frame = NULL;
+	size_t tries;
 
-	return NULL;
+	/* Victims that were mapped again have been passed by the
+	 * clock hand, so each try looks at different frames. */
+	for (tries = 0; frame == NULL && tries < frame_cnt ();
+			tries += EVICT_BATCH)
+		frame = vm_evict_batch ();
+	return frame;
 }
 
 /* palloc() and get frame. If there is no available page, evict the page
- * and return it. This always return valid address. That is, if the user pool
- * memory is full, this function evicts the frame to get the available memory
- * space.*/
+ * and return it.  If the user pool memory is full, this function evicts
+ * a frame to get the available memory space.  The frame is returned
+ * pinned, with no page.  Returns a null pointer if nothing can be
+ * evicted. */
 static struct frame *
 vm_get_frame (void) {
-	struct frame *frame = NULL;
-	/* TODO: Fill this function. */
+	struct frame *frame = frame_alloc ();
 
-	ASSERT (frame != NULL);
-	ASSERT (frame->page == NULL);
+	if (frame == NULL) {
+		long long before = evict_cnt;
+
+		frame = vm_evict_frame ();
+		if (frame != NULL)
+			frame_list_move (frame, FRAME_A1IN);
+		direct_stall_cnt++;
+		direct_evict_cnt += evict_cnt - before;
+		kswapd_kick = true;
+		if (kswapd_enabled && !kswapd_started) {
+			kswapd_started = true;
+			sema_up (&kswapd_start_sema);
+		}
+	}
+
+	ASSERT (frame == NULL || frame->page == NULL);
 	return frame;
 }
 
+/* The background reclaim thread. */
+static void
+kswapd (void *aux UNUSED) {
+	sema_down (&kswapd_start_sema);
+	for (;;) {
+		size_t free_cnt, freed;
+
+		timer_sleep (KSWAPD_SLEEP);
+		free_cnt = palloc_user_free ();
+		if (free_cnt >= KSWAPD_LOW && !kswapd_kick)
+			continue;
+		kswapd_kick = false;
+		if (free_cnt >= KSWAPD_HIGH)
+			continue;
+
+		/* One batch per hold of VM_LOCK, so faults get in between. */
+		kswapd_wake_cnt++;
+		for (freed = 0; free_cnt + freed < KSWAPD_HIGH; ) {
+			long long before;
+			struct frame *frame;
+
+			lock_acquire (&vm_lock);
+			before = evict_cnt;
+			frame = vm_evict_batch ();
+			if (frame != NULL)
+				frame_free (frame);
+			kswapd_evict_cnt += evict_cnt - before;
+			freed += evict_cnt - before;
+			lock_release (&vm_lock);
+			if (frame == NULL)
+				break;
+		}
+	}
+}
+
+/* Starts the background reclaim thread, unless -nokswapd was
+ * given. */
+void
+kswapd_start (void) {
+	if (!kswapd_enabled)
+		return;
+	sema_init (&kswapd_start_sema, 0);
+	thread_create ("kswapd", PRI_DEFAULT, kswapd, NULL);
+}
+
+/* Detaches PAGE from its frame and frees the frame, unless the
+ * frame is still shared copy-on-write with other pages.  The
+ * caller unmaps the page. */
+void
+vm_free_frame (struct page *page) {
+	struct frame *frame = page->frame;
+
+	ASSERT (frame != NULL);
+	if (page->text != NULL) {
+		if (text_unmap (page->text, page))
+			frame_free (frame);
+		return;
+	}
+	page->frame = NULL;
+	if (frame_put (frame, page))
+		frame_free (frame);
+}
+
+/* Maps FRAME, already holding a page, at PAGE as well, adding a
+ * reference and putting PAGE on FRAME's chain. */
+static void
+frame_get (struct frame *frame, struct page *page) {
+	ASSERT (page->rmap_next == NULL);
+	frame->ref_cnt++;
+	page->frame = frame;
+	if (frame != zero_frame) {
+		page->rmap_next = frame->page;
+		frame->page = page;
+	}
+}
+
+/* Drops PAGE's reference to FRAME, which may be shared, and takes
+ * PAGE off FRAME's chain.  Returns true if it was the last one. */
+static bool
+frame_put (struct frame *frame, struct page *page) {
+	ASSERT (frame->ref_cnt > 0);
+	if (frame != zero_frame) {
+		struct page **p;
+
+		for (p = &frame->page; *p != page; p = &(*p)->rmap_next)
+			ASSERT (*p != NULL);
+		*p = page->rmap_next;
+	}
+	page->rmap_next = NULL;
+	return --frame->ref_cnt == 0;
+}
+
 /* Growing the stack. */
 static void
-vm_stack_growth (void *addr UNUSED) {
+vm_stack_growth (void *addr) {
+	vm_alloc_page (VM_ANON | VM_MARKER_0, pg_round_down (addr), true);
 }
 
-/* Handle the fault on write_protected page */
+/* Handle the fault on write_protected page: a write to a writable
+ * page that fork() left sharing its frame read-only.  The last
+ * page to write gets the frame itself, without a copy.  The
+ * caller holds VM_LOCK. */
 static bool
-vm_handle_wp (struct page *page UNUSED) {
+vm_handle_wp (struct page *page) {
+	struct frame *old = page->frame;
+	struct frame *new;
+	uint64_t *pml4 = page->owner->pml4;
+	bool pinned;
+
+	if (!page->writable)
+		return false;
+
+	/* Evicted while we waited for the lock. */
+	if (old == NULL)
+		return vm_do_claim_page (page);
+
+	if (old->ref_cnt == 1) {
+		ASSERT (old->page == page);
+		cow_reuse_cnt++;
+		return pml4_set_writable (pml4, page->va, true);
+	}
+
+	/* Keep OLD from being evicted to make room for its copy.  The
+	 * zero frame is pinned for good. */
+	pinned = old->flags & FRAME_PINNED;
+	old->flags |= FRAME_PINNED;
+	new = vm_get_frame ();
+	if (new == NULL) {
+		if (!pinned)
+			old->flags &= ~FRAME_PINNED;
+		return false;
+	}
+	if (old == zero_frame) {
+		memset (new->kva, 0, PGSIZE);
+		zero_copy_cnt++;
+	} else {
+		memcpy (new->kva, old->kva, PGSIZE);
+		cow_copy_cnt++;
+	}
+	if (!pinned)
+		old->flags &= ~FRAME_PINNED;
+	frame_put (old, page);
+	new->page = page;
+	page->frame = new;
+	if (!pml4_set_page (pml4, page->va, new->kva, true)) {
+		vm_free_frame (page);
+		return false;
+	}
+	new->flags &= ~FRAME_PINNED;
+	return true;
+}
+
+/* Returns the shared frame of zeros. */
+struct frame *
+vm_zero_frame (void) {
+	return zero_frame;
+}
+
+/* Remaps PAGE, which holds a private frame, read-only to INTO,
+ * which must hold the same bytes, and frees PAGE's frame.  A write
+ * copies it again in vm_handle_wp().  The dirty bit carries over,
+ * since it tells whether the page still matches its swap slot.
+ * The caller holds VM_LOCK. */
+void
+vm_merge_frame (struct page *page, struct frame *into) {
+	uint64_t *pml4 = page->owner->pml4;
+	struct frame *old = page->frame;
+	bool dirty = pml4_is_dirty (pml4, page->va);
+
+	ASSERT (old->ref_cnt == 1 && old->page == page);
+	pml4_clear_page (pml4, page->va);
+	if (!pml4_set_page (pml4, page->va, into->kva, false))
+		PANIC ("vm_merge_frame: cannot remap %p", page->va);
+	if (dirty)
+		pml4_set_dirty (pml4, page->va, true);
+	if (frame_put (old, page))
+		frame_free (old);
+	frame_get (into, page);
+}
+
+/* Returns true if PAGE is an anonymous page that has never been
+ * loaded and starts out as zeros. */
+static bool
+is_fresh_anon (struct page *page) {
+	return VM_TYPE (page->operations->type) == VM_UNINIT
+		&& VM_TYPE (page->uninit.type) == VM_ANON
+		&& page->uninit.init == NULL;
+}
+
+/* Maps the zero frame read-only at fresh anonymous PAGE, which
+ * gets a frame of its own on its first write, in vm_handle_wp().
+ * The caller holds VM_LOCK. */
+static bool
+vm_map_zero_page (struct page *page) {
+	/* Initialize PAGE as anonymous without filling a frame. */
+	if (!swap_in (page, NULL)
+			|| !pml4_set_page (page->owner->pml4, page->va, zero_frame->kva,
+				false))
+		return false;
+	frame_get (zero_frame, page);
+	zero_map_cnt++;
+	return true;
+}
+
+/* If PAGE is not loaded and its contents come from a file,
+ * returns where in the file; otherwise, returns a null pointer. */
+static struct file_page *
+page_file_info (struct page *page) {
+	if (page->frame != NULL)
+		return NULL;
+	if (VM_TYPE (page->operations->type) == VM_UNINIT)
+		return page->uninit.aux;
+	if (VM_TYPE (page->operations->type) == VM_FILE)
+		return &page->file;
+	return NULL;
+}
+
+/* Returns true if NEXT, a page just above PREV in the address
+ * space, continues PREV's run of file data: not loaded, in the
+ * same file, and starting where PREV's full page ends. */
+static bool
+continues_run (struct page *prev, struct page *next) {
+	struct file_page *a = page_file_info (prev);
+	struct file_page *b = next != NULL ? page_file_info (next) : NULL;
+
+	return a != NULL && b != NULL && !a->shared && !b->shared
+		&& a->read_bytes == PGSIZE && b->ofs == a->ofs + PGSIZE
+		&& file_get_inode (a->file) == file_get_inode (b->file);
+}
+
+/* Turns PAGE, which is not loaded yet, into its final type
+ * without reading anything, because its frame was filled by the
+ * caller. */
+static bool
+vm_init_filled (struct page *page) {
+	void *aux = page->uninit.aux;
+
+	if (VM_TYPE (page->operations->type) != VM_UNINIT)
+		return true;
+	if (!page->uninit.page_initializer (page, page->uninit.type, NULL))
+		return false;
+
+	/* A lazily loaded anonymous page's loader, which frees its
+	 * aux, is not going to run. */
+	if (VM_TYPE (page->operations->type) == VM_ANON)
+		file_page_free (aux);
+	return true;
+}
+
+/* Counts PAGE as a fault saved if fault-around mapped it and it
+ * has been used since.  Called before PAGE's accessed bit is
+ * cleared or its frame is taken away. */
+static void
+account_ahead (struct page *page) {
+	if (page->ahead && pml4_is_accessed (page->owner->pml4, page->va))
+		around_used_cnt++;
+	page->ahead = false;
+}
+
+/* Loads PAGE, which faulted, together with its neighbours in the
+ * fault-around window that continue the same run of file data,
+ * with one read into physically contiguous frames.  Under
+ * MADV_SEQUENTIAL the window is as large as it gets and starts at
+ * PAGE; under MADV_RANDOM there is none.  Neighbours
+ * are mapped without their accessed bit, so eviction takes them
+ * first if they go unused.  Returns false, having done nothing,
+ * if there is no neighbour to load or no run of free frames, so
+ * the caller loads PAGE alone.  The caller holds VM_LOCK. */
+static bool
+vm_fault_around (struct page *page) {
+	struct supplemental_page_table *spt = &page->owner->spt;
+	struct page *pages[FAULT_AROUND_MAX];
+	size_t window = fault_around_pages;
+	uint8_t *start, *end, *va;
+	struct file_page *info;
+	struct frame *frames;
+	bool success = false;
+	size_t cnt, i;
+	off_t bytes;
+
+	if (page->advice == MADV_SEQUENTIAL)
+		window = FAULT_AROUND_MAX;
+	else if (page->advice == MADV_RANDOM)
+		window = 1;
+	if (window > FAULT_AROUND_MAX)
+		window = FAULT_AROUND_MAX;
+	info = page_file_info (page);
+	if (window <= 1 || info == NULL || info->shared)
+		return false;
+	start = page->advice == MADV_SEQUENTIAL ? (uint8_t *) page->va
+		: (uint8_t *) ROUND_DOWN ((uint64_t) page->va, window * PGSIZE);
+	end = start + window * PGSIZE;
+
+	/* Find the run through PAGE, within the window. */
+	for (va = page->va; va > start; va -= PGSIZE) {
+		struct page *prev = spt_find_page (spt, va - PGSIZE);
+		if (prev == NULL || !continues_run (prev, spt_find_page (spt, va)))
+			break;
+	}
+	for (cnt = 0; va < end; va += PGSIZE) {
+		pages[cnt++] = spt_find_page (spt, va);
+		if (va + PGSIZE < end
+				&& !continues_run (pages[cnt - 1], spt_find_page (spt, va + PGSIZE)))
+			break;
+	}
+	if (cnt == 1)
+		return false;
+
+	/* Eviction is not worth it for pages that may go unused. */
+	frames = frame_alloc_multiple (cnt);
+	if (frames == NULL)
+		return false;
+
+	info = page_file_info (pages[0]);
+	bytes = (cnt - 1) * PGSIZE + page_file_info (pages[cnt - 1])->read_bytes;
+	if (file_read_at (info->file, frames->kva, bytes, info->ofs) != bytes) {
+		for (i = 0; i < cnt; i++)
+			frame_free (frames + i);
+		return false;
+	}
+	memset ((uint8_t *) frames->kva + bytes, 0, cnt * PGSIZE - bytes);
+
+	/* A page that cannot be mapped is left to load on its own
+	 * fault. */
+	for (i = 0; i < cnt; i++) {
+		struct page *p = pages[i];
+		struct frame *frame = frames + i;
+
+		if (!pml4_set_page (p->owner->pml4, p->va, frame->kva, p->writable)) {
+			frame_free (frame);
+			continue;
+		}
+		if (!vm_init_filled (p)) {
+			pml4_clear_page (p->owner->pml4, p->va);
+			frame_free (frame);
+			continue;
+		}
+		frame->page = p;
+		p->frame = frame;
+		p->ahead = p != page;
+		frame->flags &= ~FRAME_PINNED;
+		if (p == page) {
+			twoq_admit (p, frame);
+			success = true;
+		} else
+			around_mapped_cnt++;
+	}
+	around_cnt++;
+	return success;
+}
+
+/* Returns true if a fault at ADDR with the stack pointer at RSP
+ * looks like the stack growing: within STACK_MAX of the top of
+ * the stack and no further below RSP than a PUSH reaches. */
+static bool
+is_stack_access (const void *addr, const void *rsp) {
+	const uint8_t *p = addr;
+
+	return p < (uint8_t *) USER_STACK
+		&& p >= (uint8_t *) USER_STACK - STACK_MAX
+		&& p >= (uint8_t *) rsp - 8;
+}
+
+/* Returns true if loading PAGE, which is not in memory, has to
+ * read it from a file or from swap, making the fault a major one.
+ * Fresh anonymous pages, pages in the swap cache and text cached
+ * for another process need no I/O. */
+static bool
+is_major_fault (struct page *page) {
+	struct file_page *info = page_file_info (page);
+
+	if (is_fresh_anon (page))
+		return false;
+	if (info != NULL && info->shared)
+		return !text_cached (file_get_inode (info->file), info->ofs);
+	return VM_TYPE (page->operations->type) != VM_ANON
+		|| page->anon.cache == NULL;
 }
 
 /* Return true on success */
 bool
-vm_try_handle_fault (struct intr_frame *f UNUSED, void *addr UNUSED,
-		bool user UNUSED, bool write UNUSED, bool not_present UNUSED) {
-	struct supplemental_page_table *spt UNUSED = &thread_current ()->spt;
+vm_try_handle_fault (struct intr_frame *f, void *addr,
+		bool user, bool write, bool not_present) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
 	struct page *page = NULL;
-	/* TODO: Validate the fault */
-	/* TODO: Your code goes here */
+	bool success;
+
+	if (addr == NULL || !is_user_vaddr (addr))
+		return false;
+
+	page = spt_find_page (spt, addr);
+	if (!not_present) {
+		if (page == NULL || !write)
+			return false;
+		lock_acquire (&vm_lock);
+		success = vm_handle_wp (page);
+		lock_release (&vm_lock);
+		return success;
+	}
+
+	if (page == NULL) {
+		/* In a system call, F is the kernel's frame; the user
+		 * stack pointer was saved on entry. */
+		void *rsp = user ? (void *) f->rsp : thread_current ()->user_rsp;
+		if (!is_stack_access (addr, rsp))
+			return false;
+		vm_stack_growth (addr);
+		page = spt_find_page (spt, addr);
+		if (page == NULL)
+			return false;
+	}
+	if (write && !page->writable)
+		return false;
+
+	/* The page may have been mapped again, after a failed
+	 * eviction, while we waited for the lock. */
+	lock_acquire (&vm_lock);
+	if (page->frame != NULL)
+		success = true;
+	else if (!write && is_fresh_anon (page))
+		success = vm_map_zero_page (page);
+	else {
+		if (is_major_fault (page))
+			thread_current ()->major_faults++;
+		success = vm_fault_around (page) || vm_do_claim_page (page);
+	}
+	lock_release (&vm_lock);
+	return success;
+}
+
+/* Loads the pages of the current process in [START, END) that are
+ * not in memory, as faults on them would, but ahead of use.  Fresh
+ * anonymous pages have nothing to load and are left alone.  Stops
+ * at the first page that cannot be loaded.  The caller holds
+ * VM_LOCK. */
+static void
+vm_willneed (uint8_t *start, uint8_t *end) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	uint8_t *va;
+
+	for (va = start; va < end; va += PGSIZE) {
+		struct page *page = spt_find_page (spt, va);
+		long long around = around_mapped_cnt;
+
+		if (page == NULL || page->frame != NULL || is_fresh_anon (page))
+			continue;
+		if (!vm_fault_around (page) && !vm_do_claim_page (page))
+			break;
+		advise_load_cnt += 1 + around_mapped_cnt - around;
+	}
+}
+
+/* Pages out the pages of the current process in [START, END)
+ * that are in memory and private to it, a batch at a time, as
+ * eviction would.  Their contents are kept, in the file or in
+ * swap, as with BSD's MADV_DONTNEED rather than Linux's, which
+ * throws anonymous memory away.  The caller holds VM_LOCK. */
+static void
+vm_dontneed (uint8_t *start, uint8_t *end) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	struct frame *chosen[EVICT_BATCH];
+	size_t n = 0;
+	uint8_t *va;
+
+	for (va = start; va < end || n > 0; va += PGSIZE) {
+		if (va < end) {
+			struct page *page = spt_find_page (spt, va);
+			struct frame *frame = page != NULL ? page->frame : NULL;
 
-	return vm_do_claim_page (page);
+			if (frame == NULL || page->text != NULL || frame->ref_cnt > 1
+					|| (frame->flags & FRAME_PINNED))
+				continue;
+			frame->flags |= FRAME_PINNED;
+			chosen[n++] = frame;
+			if (n < EVICT_BATCH && va + PGSIZE < end)
+				continue;
+		}
+
+		long long before = evict_cnt;
+		struct frame *frame = vm_evict_frames (chosen, n);
+		if (frame != NULL)
+			frame_free (frame);
+		advise_evict_cnt += evict_cnt - before;
+		n = 0;
+	}
+}
+
+/* Applies ADVICE, one of the MADV_* values, to the pages of the
+ * current process in the LENGTH bytes from ADDR, which must be
+ * page-aligned.  Unmapped parts of the range are skipped.  Returns
+ * false if the arguments are bad. */
+bool
+vm_madvise (void *addr, size_t length, int advice) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	uint8_t *start = addr;
+	uint8_t *end = start + ROUND_UP (length, PGSIZE);
+	uint8_t *va;
+
+	if (pg_ofs (addr) != 0 || end < start || !is_user_vaddr (end - 1)
+			|| advice < MADV_NORMAL || advice > MADV_DONTNEED)
+		return false;
+
+	lock_acquire (&vm_lock);
+	switch (advice) {
+		case MADV_WILLNEED:
+			vm_willneed (start, end);
+			break;
+		case MADV_DONTNEED:
+			vm_dontneed (start, end);
+			break;
+		default:
+			for (va = start; va < end; va += PGSIZE) {
+				struct page *page = spt_find_page (spt, va);
+				if (page != NULL)
+					page->advice = advice;
+			}
+	}
+	lock_release (&vm_lock);
+	return true;
 }
 
 /* Free the page.
@@ -150,41 +1308,342 @@ vm_dealloc_page (struct page *page) {
 
 /* Claim the page that allocate on VA. */
 bool
-vm_claim_page (void *va UNUSED) {
-	struct page *page = NULL;
-	/* TODO: Fill this function */
+vm_claim_page (void *va) {
+	struct page *page = spt_find_page (&thread_current ()->spt, va);
+	bool success;
+
+	if (page == NULL)
+		return false;
+	lock_acquire (&vm_lock);
+	success = vm_do_claim_page (page);
+	lock_release (&vm_lock);
+	return success;
+}
+
+/* Maps text PAGE, which is not loaded, to the cached copy of its
+ * contents, reading them into the cache first if no other process
+ * has.  The caller holds VM_LOCK. */
+static bool
+vm_claim_text (struct page *page) {
+	struct file_page *info = page_file_info (page);
+	struct inode *inode = file_get_inode (info->file);
+	off_t ofs = info->ofs;
+	struct text_page *t = text_find (inode, ofs);
+	struct frame *frame;
 
-	return vm_do_claim_page (page);
+	if (t != NULL)
+		frame = t->frame;
+	else {
+		frame = vm_get_frame ();
+		if (frame == NULL)
+			return false;
+		if (file_read_at (info->file, frame->kva, info->read_bytes, ofs)
+				!= (off_t) info->read_bytes) {
+			frame_free (frame);
+			return false;
+		}
+		memset ((uint8_t *) frame->kva + info->read_bytes, 0,
+				PGSIZE - info->read_bytes);
+	}
+
+	if (!pml4_set_page (page->owner->pml4, page->va, frame->kva, false)) {
+		if (t == NULL)
+			frame_free (frame);
+		return false;
+	}
+	if (!vm_init_filled (page)
+			|| (t == NULL && (t = text_insert (inode, ofs, frame)) == NULL)) {
+		pml4_clear_page (page->owner->pml4, page->va);
+		if (t == NULL)
+			frame_free (frame);
+		return false;
+	}
+	text_map (t, page);
+	frame->flags &= ~FRAME_PINNED;
+	return true;
 }
 
-/* Claim the PAGE and set up the mmu. */
+/* Claim the PAGE and set up the mmu.  The caller holds VM_LOCK. */
 static bool
 vm_do_claim_page (struct page *page) {
-	struct frame *frame = vm_get_frame ();
+	struct file_page *info = page_file_info (page);
+	struct frame *frame;
+	bool cached;
+
+	if (info != NULL && info->shared)
+		return vm_claim_text (page);
+
+	frame = anon_take_cache (page);
+	cached = frame != NULL;
+	if (!cached)
+		frame = vm_get_frame ();
+	if (frame == NULL)
+		return false;
 
 	/* Set links */
 	frame->page = page;
 	page->frame = frame;
 
-	/* TODO: Insert page table entry to map page's VA to frame's PA. */
-
-	return swap_in (page, frame->kva);
+	/* Fill the frame before the page becomes visible.  The frame
+	 * stays pinned until then, so it cannot be chosen for eviction
+	 * while it is being read. */
+	if ((!cached && !swap_in (page, frame->kva))
+			|| !pml4_set_page (page->owner->pml4, page->va, frame->kva,
+				page->writable)) {
+		vm_free_frame (page);
+		return false;
+	}
+	twoq_admit (page, frame);
+	frame->flags &= ~FRAME_PINNED;
+	return true;
 }
 
 /* Initialize new supplemental page table */
 void
-supplemental_page_table_init (struct supplemental_page_table *spt UNUSED) {
+supplemental_page_table_init (struct supplemental_page_table *spt) {
+	spt->root = NULL;
+	spt->root_cnt = 0;
+	spt->page_cnt = 0;
+	spt->node_cnt = 0;
+	spt->peak_node_cnt = 0;
+}
+
+/* Initializer for a page created by share_page(), which fills it
+ * by sharing a frame instead. */
+static bool
+cow_init (struct page *page UNUSED, void *aux UNUSED) {
+	return true;
+}
+
+/* Adds to the current thread's table a copy-on-write copy of the
+ * anonymous page SRC of its parent: both map SRC's frame read-only,
+ * and the first to write gets a private copy in vm_handle_wp(). */
+static bool
+share_page (struct page *src) {
+	struct page *dst;
+	struct frame *frame;
+
+	if (!vm_alloc_page_with_initializer (VM_ANON, src->va, src->writable,
+				cow_init, NULL))
+		return false;
+	if (src->frame == NULL && !vm_do_claim_page (src))
+		return false;
+	frame = src->frame;
+
+	/* Turn DST into an anonymous page without reading anything. */
+	dst = spt_find_page (&thread_current ()->spt, src->va);
+	if (!swap_in (dst, frame->kva)
+			|| !pml4_set_page (dst->owner->pml4, dst->va, frame->kva, false))
+		return false;
+	frame_get (frame, dst);
+	pml4_set_writable (src->owner->pml4, src->va, false);
+	cow_share_cnt++;
+	return true;
+}
+
+/* spt_for_each() action for supplemental_page_table_copy(): adds a
+ * copy of SRC to the current thread's table. */
+static bool
+copy_page (struct page *src, void *aux UNUSED) {
+	struct page *dst;
+
+	if (VM_TYPE (src->operations->type) == VM_UNINIT) {
+		/* Not loaded yet: share the recipe, with its own copy of
+		 * the file mapping if there is one. */
+		void *aux = src->uninit.aux;
+		if (aux != NULL && (aux = file_page_dup (aux)) == NULL)
+			return false;
+		if (!vm_alloc_page_with_initializer (src->uninit.type, src->va,
+					src->writable, src->uninit.init, aux)) {
+			file_page_free (aux);
+			return false;
+		}
+		return true;
+	}
+
+	if (page_get_type (src) == VM_ANON)
+		return share_page (src);
+
+	/* Shared text: the child finds it in the text cache on its
+	 * first fault. */
+	if (page_get_type (src) == VM_FILE && src->file.shared) {
+		struct file_page *info = file_page_dup (&src->file);
+		if (info == NULL)
+			return false;
+		if (!vm_alloc_page_with_initializer (VM_FILE, src->va, src->writable,
+					NULL, info)) {
+			file_page_free (info);
+			return false;
+		}
+		return true;
+	}
+
+	/* Loaded file page: give the child its own frame with the same
+	 * contents, re-created from the mapping so that its destructor
+	 * writes back to the same place. */
+	if (page_get_type (src) == VM_FILE) {
+		struct file_page *info = file_page_dup (&src->file);
+		if (info == NULL)
+			return false;
+		if (!vm_alloc_page_with_initializer (VM_FILE, src->va, src->writable,
+					NULL, info)) {
+			file_page_free (info);
+			return false;
+		}
+	} else
+		return false;
+
+	if (src->frame == NULL && !vm_do_claim_page (src))
+		return false;
+
+	/* Keep SRC from being evicted to make room for DST. */
+	src->frame->flags |= FRAME_PINNED;
+	dst = spt_find_page (&thread_current ()->spt, src->va);
+	if (!vm_do_claim_page (dst)) {
+		src->frame->flags &= ~FRAME_PINNED;
+		return false;
+	}
+	memcpy (dst->frame->kva, src->frame->kva, PGSIZE);
+	src->frame->flags &= ~FRAME_PINNED;
+	if (page_get_type (src) == VM_FILE
+			&& pml4_is_dirty (src->owner->pml4, src->va))
+		pml4_set_dirty (dst->owner->pml4, dst->va, true);
+	return true;
 }
 
 /* Copy supplemental page table from src to dst */
 bool
-supplemental_page_table_copy (struct supplemental_page_table *dst UNUSED,
-		struct supplemental_page_table *src UNUSED) {
+supplemental_page_table_copy (struct supplemental_page_table *dst,
+		struct supplemental_page_table *src) {
+	bool success;
+
+	ASSERT (dst == &thread_current ()->spt);
+	lock_acquire (&vm_lock);
+	success = spt_for_each (src, NULL, (void *) KERN_BASE, copy_page, NULL);
+	lock_release (&vm_lock);
+	return success;
+}
+
+/* Pages being unmapped by unmap_range(), whose PTEs are cleared in
+ * runs of consecutive addresses. */
+struct unmap {
+	struct tlb_gather tlb;
+	uint8_t *run_start, *run_end;       /* Run of mapped pages. */
+};
+
+/* Clears the PTEs of U's current run. */
+static void
+unmap_flush_run (struct unmap *u) {
+	if (u->run_end != u->run_start)
+		pml4_clear_range (&u->tlb, u->run_start,
+				(u->run_end - u->run_start) / PGSIZE);
+	u->run_start = u->run_end = NULL;
+}
+
+/* spt_remove_range() action: adds PAGE to the run of pages whose
+ * PTEs must be cleared, if it is mapped.  The page's destructor,
+ * which runs next, still sees the PTE, including its dirty bit. */
+static bool
+unmap_page (struct page *page, void *u_) {
+	struct unmap *u = u_;
+
+	if (page->frame == NULL)
+		return true;
+	account_ahead (page);
+	if ((uint8_t *) page->va != u->run_end) {
+		unmap_flush_run (u);
+		u->run_start = page->va;
+	}
+	u->run_end = (uint8_t *) page->va + PGSIZE;
+	return true;
+}
+
+/* Destroys the pages of the current process in [START, END) and
+ * clears their mappings, with one batched TLB invalidation.
+ *
+ * A destroyed page's frame is freed before its PTE is cleared.
+ * That is safe because the process cannot run again before the
+ * TLB is invalidated here, and there is only one CPU. */
+static void
+unmap_range (void *start, void *end) {
+	struct thread *t = thread_current ();
+	struct unmap u;
+
+	lock_acquire (&vm_lock);
+	if (t->pml4 == NULL)
+		spt_remove_range (&t->spt, start, end, NULL, NULL);
+	else {
+		tlb_gather_init (&u.tlb, t->pml4);
+		u.run_start = u.run_end = NULL;
+		spt_remove_range (&t->spt, start, end, unmap_page, &u);
+		unmap_flush_run (&u);
+		tlb_gather_finish (&u.tlb);
+	}
+	lock_release (&vm_lock);
+}
+
+/* Destroys the PAGE_CNT pages of the current process starting at
+ * START, as for munmap(). */
+void
+vm_unmap_range (void *start, size_t page_cnt) {
+	unmap_range (start, (uint8_t *) start + page_cnt * PGSIZE);
 }
 
 /* Free the resource hold by the supplemental page table */
 void
-supplemental_page_table_kill (struct supplemental_page_table *spt UNUSED) {
-	/* TODO: Destroy all the supplemental_page_table hold by thread and
-	 * TODO: writeback all the modified contents to the storage. */
+supplemental_page_table_kill (struct supplemental_page_table *spt) {
+	ASSERT (spt == &thread_current ()->spt);
+
+	if (spt->page_cnt > spt_peak_pages)
+		spt_peak_pages = spt->page_cnt;
+	if (spt->peak_node_cnt > spt_peak_nodes)
+		spt_peak_nodes = spt->peak_node_cnt;
+	spt_total_nodes += spt->peak_node_cnt;
+	spt_tables++;
+
+	unmap_range (NULL, (void *) KERN_BASE);
+	ASSERT (spt->root == NULL && spt->node_cnt == 0);
+	spt->peak_node_cnt = 0;
+}
+
+/* Prints virtual memory statistics. */
+void
+vm_print_stats (void) {
+	if (spt_tables > 0)
+		printf ("SPT: %lld tables, %lld kB average and %zu kB peak overhead, "
+				"%zu pages peak\n", spt_tables,
+				spt_total_nodes * (PGSIZE / 1024) / spt_tables,
+				spt_peak_nodes * (PGSIZE / 1024), spt_peak_pages);
+	if (evict_cnt > 0)
+		printf ("Eviction: %lld frames evicted (%lld dirty, %lld shared "
+				"by %lld pages), %lld frames scanned on average, %zu at most\n",
+				evict_cnt, evict_dirty_cnt, evict_shared_cnt, evict_sharer_cnt,
+				evict_scan_cnt / evict_cnt, evict_scan_max);
+	if (evict_policy == EVICT_2Q && evict_cnt > 0)
+		printf ("2Q: %lld victims from A1in, %lld from Am, "
+				"%lld ghosts faulted back\n",
+				twoq_cold_cnt, twoq_hot_cnt, twoq_promote_cnt);
+	if (kswapd_evict_cnt + direct_evict_cnt > 0)
+		printf ("Reclaim: %lld frames evicted in the background over %lld "
+				"wakeups, %lld directly by %lld faults\n", kswapd_evict_cnt,
+				kswapd_wake_cnt, direct_evict_cnt, direct_stall_cnt);
+	if (zero_map_cnt > 0)
+		printf ("Zero page: %lld read faults mapped it, %lld later written, "
+				"%lld frames saved\n", zero_map_cnt, zero_copy_cnt,
+				zero_map_cnt - zero_copy_cnt);
+	if (around_cnt > 0)
+		printf ("Fault-around: %lld faults mapped %lld pages ahead, "
+				"%lld of them used before unmapped\n",
+				around_cnt, around_mapped_cnt, around_used_cnt);
+	if (advise_load_cnt + advise_evict_cnt > 0)
+		printf ("madvise: %lld pages loaded ahead, %lld paged out\n",
+				advise_load_cnt, advise_evict_cnt);
+	if (cow_share_cnt > 0)
+		printf ("COW: %lld frames shared, %lld copied on write, "
+				"%lld taken over by the last writer\n",
+				cow_share_cnt, cow_copy_cnt, cow_reuse_cnt);
+	file_print_stats ();
+	text_print_stats ();
+	ksm_print_stats ();
+	anon_print_stats ();
 }